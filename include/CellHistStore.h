@@ -0,0 +1,41 @@
+#ifndef CELLHISTSTORE_HH
+#define CELLHISTSTORE_HH
+
+#include <TH1D.h>
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+// Integer bin counts of one unit-width histogram per channel (memory cell 0), all cells in one array
+// at their Geometry::Index.
+// Bin layout follows TH1D(nbins,0,nbins): 0 is the underflow, 1..nbins the values, nbins+1 the overflow.
+class CellHistStore
+{
+public:
+	CellHistStore(const int nbins=0,const int n_cell=0);
+	virtual ~CellHistStore(){};
+
+	void Fill(const int index,const double x)
+	{
+		const int bin = x<0 ? 0 : (x>=nbins ? nbins+1 : (int)x+1);
+		counts[(size_t)index*(nbins+2)+bin]++;
+	}
+	void Add(const CellHistStore &other);
+	void Clear();
+	int Bins() const {return nbins;}
+	int Cells() const {return n_cell;}
+	const uint32_t *Counts(const int index) const {return &counts[(size_t)index*(nbins+2)];}
+	void CopyTo(TH1D *h,const int index) const; // Overwrite the bins and entries of h with cell index
+	TH1D *MakeTH1(const int index,const TString &name) const; // New TH1D(name,name,nbins,0,nbins) of cell index, not attached to a directory
+	static size_t Bytes(const int nbins,const int n_cell){return (size_t)n_cell*(nbins+2)*sizeof(uint32_t);}
+	// Workers, up to wanted, whose private stores of bytes_each fit in half the available memory (at least 1)
+	static int WorkersInMemory(const int wanted,const size_t bytes_each);
+
+private:
+	int nbins;
+	int n_cell;
+	vector<uint32_t> counts;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef CELLID_HH
+#define CELLID_HH
+
+// Address of one readout channel: layer 0..63, chip 0..9, memory cell 0..15, channel 0..35.
+// Held bit-packed (channel 6 bits, chip 4, layer 6, memory cell 4), so the fields are masks and shifts.
+// Files keep the legacy decimal layer*1E5 + chip*1E4 + memo*100 + channel, converted by
+// FromDecimal/Decimal; its single chip digit is what limits the chips to 10. The layers and chips
+// actually read out, and the dense index of flat per-cell arrays, are given by Geometry.
+class CellID
+{
+public:
+	static constexpr int n_layer = 64;
+	static constexpr int n_chip = 10;
+	static constexpr int n_memo = 16;
+	static constexpr int n_channel = 36; // Fixed by the SPIROC cell, 36 charges and 36 times
+
+	constexpr CellID() : bits(0) {}
+	constexpr CellID(const int layer,const int chip,const int memo,const int channel) :
+		bits((unsigned)channel | (unsigned)chip<<6 | (unsigned)layer<<10 | (unsigned)memo<<16) {}
+
+	constexpr int Layer() const {return (bits>>10)&0x3f;}
+	constexpr int Chip() const {return (bits>>6)&0xf;}
+	constexpr int Memo() const {return (bits>>16)&0xf;}
+	constexpr int Channel() const {return bits&0x3f;}
+	constexpr int Decimal() const {return Layer()*100000+Chip()*10000+Memo()*100+Channel();}
+
+	// Fields out of range (and negative values) give an ID for which Valid is false
+	static constexpr CellID FromDecimal(const int decimal)
+	{
+		return decimal<0 || decimal>=n_layer*100000 ? Invalid() :
+			Checked(decimal/100000,(decimal/10000)%10,(decimal/100)%100,decimal%100);
+	}
+	constexpr bool Valid() const {return bits!=invalid_bits;}
+
+	constexpr bool operator==(const CellID &other) const {return bits==other.bits;}
+	constexpr bool operator!=(const CellID &other) const {return bits!=other.bits;}
+
+private:
+	static constexpr unsigned invalid_bits = 0xffffffffu;
+	unsigned bits;
+
+	static constexpr CellID Invalid()
+	{
+		CellID id;
+		id.bits = invalid_bits;
+		return id;
+	}
+	static constexpr CellID Checked(const int layer,const int chip,const int memo,const int channel)
+	{
+		return chip<n_chip && memo<n_memo && channel<n_channel ? CellID(layer,chip,memo,channel) : Invalid();
+	}
+};
+
+static_assert(CellID(63,9,15,35).Decimal()==6391535,"CellID decimal layout");
+static_assert(CellID::FromDecimal(1230507).Layer()==12 && CellID::FromDecimal(1230507).Chip()==3 &&
+	CellID::FromDecimal(1230507).Memo()==5 && CellID::FromDecimal(1230507).Channel()==7,"CellID decimal decode");
+static_assert(!CellID::FromDecimal(36).Valid() && !CellID::FromDecimal(6400000).Valid() && !CellID::FromDecimal(-1).Valid(),"CellID invalid IDs");
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef CHANNELUNPACK_HH
+#define CHANNELUNPACK_HH
+
+using namespace std;
+
+// Output columns of one memory cell, 36 entries each in readout order (channel ID 35 first)
+struct CellColumns
+{
+	int *hitTag;
+	int *gainTag_tdc;
+	int *gainTag;
+	double *HG_Charge;
+	double *LG_Charge;
+	double *Hit_Time;
+};
+
+// Byte-swap and unpack the 72 big-endian words of a memory cell (36 TDC/HG, 36 ADC/LG).
+// Auto gain: HG or LG is the ADC by the gain bit, the other -1, Hit_Time the TDC.
+// Manual gain: HG is the TDC word, LG the ADC word, Hit_Time and gainTag -1.
+void UnpackCell(const unsigned char *cell, const bool b_auto_gain, const CellColumns &out);
+// CellIDs of memory cell 0 of a chip in readout order; memory cell m adds m*100
+const int *CellIDRow(const int layer, const int chip);
+// Instruction set picked at runtime: "avx2", "sse2" or "scalar"
+const char *ChannelUnpackISA();
+
+#endif
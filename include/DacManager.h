@@ -12,10 +12,28 @@
 #include <fstream>
 #include <string>
 #include <algorithm>
+#include <memory>
 #include "HBase.h"
+#include "SparseHist2D.h"
+#include "Geometry.h"
+#include "DatManager.h"
 
 using namespace std;
 
+// Fit of one cell's HG vs LG histogram, written out by AnaDac
+struct CalibFit
+{
+	CellID id;
+	double slope=-10.;
+	double fit_goodness=10000.;
+	double highgain_platform=10000.; // Saturated HG, 10000 if there is no plateau
+	double line_slope=0.;     // Closed-form line of the fit range, HG on LG (slope is 1/p0 of the fit)
+	double line_intercept=0.;
+	bool line_agrees=true;    // Fit and line within DacManager::line_tolerance
+	unique_ptr<TH2D> hist; // With f1 attached, as after TH1::Fit
+	string message; // Printed when the writer reaches the cell
+};
+
 class DacManager : public HBase{
 public:
 	// TFile 	*fin;
@@ -30,17 +48,17 @@ public:
 	// vector<int>     *gainTags;
 	// vector<double>  *charges;
 	// vector<double>  *times;
-	vector<int> vec_cellid;
-	map<int,TH2D*> map_cellid_calib;
+	vector<int> vec_cellid; // Cells hit, in the order they were first seen
+	vector< unique_ptr<SparseHist2D> > cell_calib; // HG vs LG by Geometry::Index, null until the cell is hit
+	SparseHist2D calib_empty; // Binning of the mode, nothing filled
 	map<int,TH2D*> map_layer_dacslope;
 	map<int,TH2D*> map_layer_fit;
 	map<int,TH2D*> map_layer_highgainplatform;
-	map<int,int> map_cellid_exist;
 	TH2D	*hdacslope;
 	TH2D	*hfit;
 	TH2D	*hhighgain_platform;
-	TH2D	*hped_high;
-	TH2D	*hped_low;
+	TH2D	*hped_high=nullptr;
+	TH2D	*hped_low=nullptr;
 	double highgain_min=1000.,highgain_max=0.;
 	double lowgain_min=1000.,lowgain_max=0.;
 	double _slope=0.;
@@ -51,10 +69,44 @@ public:
 
 	DacManager(const TString &outname);
 	virtual ~DacManager();
-	virtual int AnaDac(const std::string &list,const TString &mode);
+	virtual int AnaDac(const std::string &list,const TString &mode); // 1 once the calibration is written, 0 on failure
 	virtual void SetPedestal(const TString &pedname);
 	// virtual void ReadTree(TString fname);
 	virtual void SaveCanvas(TH2D* h,TString name);
+	void SetEngine(const string &e){engine = e;}; // native or rdf (RDataFrame over the whole list)
+	void SetMinimizer(const string &m){minimizer = m;}; // Of the fits, empty keeps ROOT's default; Minuit2 fits on nthreads
+	void SetRangeScan(const bool b){range_scan = b;}; // Narrow the fit range to where the HG/LG line is good, off: whole range
+	void SetThreads(int n){nthreads = n;}; // File readers and fit workers (slots of the rdf engine), 0 means one per core
+	void SetGeometry(const Geometry &g,const Long64_t detect=0){geometry = g; detect_entries = detect;}; // detect!=0: Geometry::Detect on the list instead
+	// Fused pipeline: decoders feed their events through DecodedSink (one worker per concurrent
+	// decoder), FinishDecoded then fits and writes as AnaDac does
+	void StartDecoded(const TString &mode,const int workers);
+	EventSink DecodedSink(const string &dat_file,const int worker);
+	int FinishDecoded(); // As AnaDac
+
+private:
+	string engine="native";
+	string minimizer="";
+	bool range_scan=false;
+	int nthreads=0;
+	Geometry geometry;
+	Long64_t detect_entries=0;
+	TString calib_mode; // dac or cosmic, set by Book
+	bool b_dac=false;
+	bool b_cosmic=false;
+	vector< vector< unique_ptr<SparseHist2D> > > worker_calib; // Per worker cells of FillFiles and the fused pipeline
+	void Book(const TString &mode); // Histograms and cell storage of the geometry
+	int WriteCalib();
+	int SelectHit(const int hittag,const int cellid,const int sel_channel) const; // Cell index, -1 if the hit is not used
+	void StartWorkers(const int workers);
+	void MergeWorkers();
+	void FillCalib(const int index,const double highgain,const double lowgain);
+	int FillFiles(const TString &mode);
+	int FillRDF(const TString &mode);
+	// Largest difference of the fitted slope from the closed-form one, relative, and of the intercept, relative to the range
+	static constexpr double line_tolerance = 0.05;
+	CalibFit FitCell(const int index,const TString &mode,TF1 *f) const;
+	static double FindPlateau(const SparseHist2D &sparse); // HG where the high gain saturates
 };
 
 #endif
@@ -0,0 +1,44 @@
+#ifndef DATGENERATOR_HH
+#define DATGENERATOR_HH
+
+#include <vector>
+#include <string>
+#include <random>
+
+using namespace std;
+
+// Shape of the synthetic run written by DatGenerator
+struct GeneratorSettings
+{
+	int events=1000;
+	int layers=40;          // Layers 0..layers-1 report in every event
+	int chips=9;            // Chips per layer
+	int memory_depth=1;     // Memory cells per chip
+	double occupancy=0.1;   // Probability of HitTag per channel
+	bool auto_gain=false;   // Set the gain bits as in auto-gain runs
+	bool cherenkov=false;   // Random cherenkov bits in the counter word
+	unsigned int seed=1;
+};
+
+// Writes .dat files in the event bag / SPIROC bag format of Doc/datastructure.md
+class DatGenerator
+{
+public:
+	DatGenerator(const GeneratorSettings &settings);
+	virtual ~DatGenerator(){};
+
+	void Event(vector<unsigned char> &out); // Append the next event bag
+	int Write(const string &fname);         // Write settings.events event bags, 0 on failure
+
+private:
+	GeneratorSettings s;
+	mt19937 rng;
+	int event_no;
+	int cycleID;
+	int triggerID;
+
+	void Word(vector<unsigned char> &out,const int word);
+	void Chip(vector<unsigned char> &out,const int chip);
+};
+
+#endif
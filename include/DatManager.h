@@ -3,6 +3,7 @@
 
 #include<TFile.h>
 #include<TTree.h>
+#include<Compression.h>
 #include<fstream>
 #include<iostream>
 #include<sstream>
@@ -10,24 +11,120 @@
 #include<vector>
 #include<TMath.h>
 #include<string>
+#include<functional>
+#include "MappedFile.h"
+#include "MarkerScan.h"
+#include "EventBuilder.h"
+#include "Geometry.h"
 
 using namespace std;
 
+// Per-file result of Decode, printed in the DAT-ROOT summary table
+struct DecodeSummary
+{
+	string file;
+	int status=0;
+	int events=0;
+	int bags=0;
+	int abnormal_events=0;
+	int abnormal_chipbuffers=0;
+	double seconds=0.;
+};
+
+// Layout and storage settings of the Raw_Hit tree, DAT-ROOT/output in the config
+struct OutputSettings
+{
+	bool compact=false;      // 16-bit charges, time and BCID, 8-bit tags, instead of double and int
+	string compression="";   // ZLIB, LZ4, ZSTD or LZMA, empty keeps the ROOT default
+	int compression_level=1;
+	int basket_size=32000;   // Bytes per branch basket
+	long autoflush=-30000000; // Entries (>0) or bytes (<0) between flushes, as in TTree::SetAutoFlush
+	bool zero_suppression=false;  // Keep only channels with HitTag set, and add the Layer_Hits and Pedestal_Sample branches
+	double pedestal_fraction=0.01; // Fraction of events still written with every channel under zero suppression
+	bool write=true;         // Write Raw_Hit at all, off when the events only go to the sinks
+};
+
+// Read-only view of one SPIROC bag inside an event bag, read as 16-bit big-endian words.
+// Word(i) skips the cycleID and triggerID words: start markers, chip data, end markers.
+struct SpirocBag
+{
+	const unsigned char *bytes=nullptr; // First byte of the start marker
+	size_t n_words=0;                   // Words from the start marker to the end marker, 0 if empty
+	size_t Size() const {return n_words ? n_words-3 : 0;}
+	const unsigned char *WordBytes(const size_t i) const {return bytes+2*(i<2 ? i : i+3);}
+	int Word(const size_t i) const {const unsigned char *p=WordBytes(i); return p[0]*0x100+p[1];}
+	void Clear(){bytes=nullptr;n_words=0;}
+};
+
+// An event bag found by the index pass, with the cherenkov counter it is decoded with
+struct EventBagRef
+{
+	const unsigned char *bag;
+	size_t size;
+	long cherenkov_counter;
+};
+
+// Decoded events of consecutive event bags, stored column-wise until FillChunk
+struct EventChunk
+{
+	// One entry per event
+	vector< int > cycleID;
+	vector< int > triggerID; // Before loop correction
+	vector< long > cherenkov_counter;
+	vector< size_t > hit_end; // End of the event in the hit columns
+	// One entry per channel
+	vector< int > cellID;
+	vector< int > bcid;
+	vector< int > hitTag;
+	vector< int > gainTag_tdc;
+	vector< int > gainTag;
+	vector< double > HG_Charge;
+	vector< double > LG_Charge;
+	vector< double > Hit_Time;
+	int bags=0;
+	int abnormal_events=0;
+	void Clear(){
+		cycleID.clear();triggerID.clear();cherenkov_counter.clear();hit_end.clear();
+		cellID.clear();bcid.clear();hitTag.clear();gainTag_tdc.clear();gainTag.clear();
+		HG_Charge.clear();LG_Charge.clear();Hit_Time.clear();
+		bags=0;abnormal_events=0;
+	}
+};
+
+// Receives every decoded event in file order, before zero suppression: hits [hit_begin,hit_end) of
+// the chunk columns, event_no counted from 0 in the file and the Event_Time of Raw_Hit. Fed by
+// FillChunk, on the thread calling Decode.
+using EventSink = function<void(const EventChunk &chunk,const size_t hit_begin,const size_t hit_end,const int event_no,const unsigned int event_time)>;
+
+// State carried from one event to the next while the chunks are filled in file order
+struct DecodeCarry
+{
+	int Bag_No=0;
+	int Event_No=0;
+	int Cherenkov_Event_No1=0;
+	int Cherenkov_Event_No2=0;
+	int Cherenkov_Event_No=0;
+	int Abnormal_Event_No=0;
+	int Loop_No=0;
+	long last_trigID=-1;
+};
+
 class DatManager
 {
 public:
 	static const int channel_FEE = 73;//(36charges+36times + BCIDs )*16column+ ChipID
-	static const int Layer_No = 40;
-	static const int chip_No = 9;
 	static const int channel_No = 36;
+	static const size_t chunk_bytes = 4UL<<20; // Bytes of .dat indexed per chunk in parallel decoding
 	string outname="";
 	int   _Run_No;
 	int   _cycleID;
 	int   _triggerID;
 	unsigned int   _Event_Time;
-	vector< int > _buffer_v;
-	vector< int > _EventBuffer_v;
-	vector< int > _chip_v[Layer_No][chip_No];
+	SpirocBag _spiroc; // SPIROC bag being decoded
+	vector< unsigned char > _EventBuffer_v;
+	vector< BagMarker > _markers; // Marker offsets inside the current event bag
+	size_t _i_marker=0;          // First marker of _markers not consumed yet
+	EventBuilder _builder; // Chip data of the event being decoded
 	vector< int > _cellID;
 	vector< int > _bcid;
 	vector< int > _hitTag;
@@ -37,27 +134,41 @@ public:
 	vector< double > _HG_Charge;
 	vector< double > _LG_Charge;
 	vector< double > _Hit_Time;
+	// Branches of the compact schema
+	vector< UShort_t > _bcid16;
+	vector< Char_t > _hitTag8;
+	vector< Char_t > _gainTag_tdc8;
+	vector< Char_t > _gainTag8;
+	vector< Short_t > _HG_Charge16;
+	vector< Short_t > _LG_Charge16;
+	vector< Short_t > _Hit_Time16;
+	vector< int > _layer_hits; // Hit channels per layer, written under zero suppression
+	int _pedestal_sample=1; // 1 for the events written with every channel under zero suppression
+	vector< size_t > _hit_index; // Hits of the event kept by zero suppression
+	OutputSettings output; // Used by Decode
+	Geometry geometry; // Layers and chips accepted from the SPIROC bags, set with SetGeometry
+	vector< EventSink > sinks; // Fed with the events of Decode, next to (or instead of) the Raw_Hit tree
 	int count_chipbuffer=0;
+	DecodeSummary summary; // Filled by Decode
 
 	DatManager(){};
 	virtual ~DatManager();
-	int Decode(const string &binary_name,const string &raw_name,const bool b_auto_gain=0,const bool b_cherenkov=0);
-	int CatchEventBag(ifstream &f_in, vector<int> &buffer_v, long &cherenkov_counter);
-	int CatchSPIROCBag(vector<int> &EventBuffer_v,vector<int> &buffer_v,int &layer_id,int &cycleID,int &triggerID);
-	int CatchSPIROCBag(ifstream &f_in,vector<int> &buffer_v,int &layer_id,int &cycleID,int &triggerID);
+	void SetGeometry(const Geometry &g){geometry = g; _builder = EventBuilder(g.Layers(),g.Chips());}
+	int Decode(const string &binary_name,const string &raw_name,const bool b_auto_gain=0,const bool b_cherenkov=0,const bool b_mmap=1,const int nthreads=1);
+	int DecodeEventBag(const unsigned char *bag,const size_t bag_size,const long cherenkov_counter,const bool b_auto_gain,EventChunk &chunk);
+	void FillChunk(const EventChunk &chunk,TTree *tree,DecodeCarry &carry,const bool b_cherenkov); // tree may be null when only the sinks are fed
+	bool PedestalSample(const int event_no) const; // Event written unsuppressed for pedestal analysis
+	int CatchEventBag(ifstream &f_in, vector<unsigned char> &buffer_v, long &cherenkov_counter);
+	int CatchEventBag(const MappedFile &f_in, size_t &pos, const unsigned char* &bag, size_t &bag_size, long &cherenkov_counter);
+	int CatchSPIROCBag(const unsigned char *EventBuffer, const size_t size, size_t &pos, SpirocBag &spiroc,int &layer_id,int &cycleID,int &triggerID); // Needs _markers from ScanMarkers over EventBuffer
+	static void PrintSummary(const vector<DecodeSummary> &summaries);
 	void SetTreeBranch(TTree *tree);
 	void BranchClear();
-	int DecodeAEvent(vector<int> &chip_v,int layer_ID,int Memo_ID,const bool b_auto_gain);
+	int DecodeAEvent(int layer_ID,int chip_ID,int Memo_ID,const bool b_auto_gain,EventChunk &chunk);
 	int Chipbuffer_empty(){
-		int b_chipbuffer=0;
-		for (int i_layer = 0; i_layer < Layer_No; ++i_layer){
-		    for (int i_chip = 0; i_chip < chip_No; ++i_chip){
-		        if(_chip_v[i_layer][i_chip].size()) b_chipbuffer=1;
-		    }
-    		}
-    		return b_chipbuffer;
+		return _builder.Pending();
 	}
-	int FillChipBuffer(vector<int> &buffer_v,int cycleID,int triggerID,int layer_id);
+	int FillChipBuffer(SpirocBag &spiroc,int cycleID,int triggerID,int layer_id);
 };
 
 #endif
@@ -0,0 +1,51 @@
+#ifndef EVENTBUILDER_HH
+#define EVENTBUILDER_HH
+
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+// Chip data of the event being built, preallocated for layers 0..layers-1 and chips 0..chips-1.
+// Each chip has cell_SP slots of 72 words (36 TDC/HG + 36 ADC/LG) plus one BCID per slot,
+// and an occupancy bit, so nothing is allocated while filling and "is anything pending"
+// is a test of the layer mask. Words are kept big-endian as they come from the bag and are
+// byte-swapped by UnpackCell only for the cells that are decoded.
+class EventBuilder
+{
+public:
+	static const int max_layer = 64;  // Bits of the layer mask
+	static const int max_chip = 16;   // Bits of a chip mask
+	static const int cell_SP = 16;    // Memory cells kept per chip
+	static const int cell_words = 72; // Data words of one memory cell
+
+	EventBuilder(const int layers=40,const int chips=9);
+	virtual ~EventBuilder(){};
+
+	// words points to n_cell*72 data words, n_cell BCIDs and the chip ID as 16-bit big-endian
+	// byte pairs, straight from the SPIROC bag. Only the last cell_SP cells are kept if the chip reports more.
+	void Fill(const int layer,const int chip,const unsigned char *words,const int n_cell);
+	void Clear();
+	bool Pending() const {return layer_mask!=0;}
+	int Layers() const {return layers;}
+	int Chips() const {return chips;}
+	uint64_t LayerMask() const {return layer_mask;}
+	unsigned int ChipMask(const int layer) const {return chip_mask[layer];}
+	int Depth(const int layer,const int chip) const {return depth[layer*chips+chip];} // Cells reported by the chip
+	int Cells(const int layer,const int chip) const {return n_cell[layer*chips+chip];} // Cells kept
+	// 72 big-endian words of the cell: 36 TDC/HG then 36 ADC/LG
+	const unsigned char *Cell(const int layer,const int chip,const int cell) const {return &data[((layer*chips+chip)*cell_SP+cell)*cell_words*2];}
+	int BCID(const int layer,const int chip,const int cell) const {const unsigned char *b=&bcid[((layer*chips+chip)*cell_SP+cell)*2]; return b[0]<<8 | b[1];}
+
+private:
+	int layers;
+	int chips;
+	vector<unsigned char> data;
+	vector<unsigned char> bcid;
+	vector<uint8_t> n_cell;
+	vector<int> depth;
+	uint64_t layer_mask;
+	vector<uint16_t> chip_mask;
+};
+
+#endif
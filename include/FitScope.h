@@ -0,0 +1,50 @@
+#ifndef FITSCOPE_HH
+#define FITSCOPE_HH
+
+#include <TH1.h>
+#include "Math/MinimizerOptions.h"
+#include "ThreadPool.h"
+#include <string>
+#include <iostream>
+
+using namespace std;
+
+// Global ROOT settings of a pool of cell fits, restored when the scope ends. Histograms made by the
+// workers stay out of gDirectory, and the fits use minimizer, ROOT's default if it is empty. Only
+// Minuit2 is thread safe: with any other (TMinuit is the usual default) the fits run on one thread.
+// Minuit2 results can differ from TMinuit ones in the last digits, so it has to be asked for.
+class FitScope
+{
+public:
+	FitScope(const string &_minimizer,const int threads,const char *what) :
+		minimizer(_minimizer),
+		previous_type(ROOT::Math::MinimizerOptions::DefaultMinimizerType()),
+		previous_algo(ROOT::Math::MinimizerOptions::DefaultMinimizerAlgo()),
+		add_directory(TH1::AddDirectoryStatus())
+	{
+		TH1::AddDirectory(false);
+		if(minimizer!="")ROOT::Math::MinimizerOptions::SetDefaultMinimizer(minimizer.c_str());
+		const string used = minimizer!="" ? minimizer : previous_type;
+		workers = used=="Minuit2" ? ThreadPool::Resolve(threads) : 1;
+		if(workers==1 && ThreadPool::Resolve(threads)>1)
+			cout<<what<<" fits on one thread with "<<used<<", set fit-minimizer to Minuit2 to use "<<ThreadPool::Resolve(threads)<<endl;
+	}
+	~FitScope()
+	{
+		ROOT::Math::MinimizerOptions::SetDefaultMinimizer(previous_type.c_str(),previous_algo.c_str());
+		TH1::AddDirectory(add_directory);
+	}
+	FitScope(const FitScope &) = delete;
+	FitScope &operator=(const FitScope &) = delete;
+
+	int Workers() const {return workers;} // Threads the fits may use
+
+private:
+	string minimizer;
+	string previous_type;
+	string previous_algo;
+	bool add_directory;
+	int workers;
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef GEOMETRY_HH
+#define GEOMETRY_HH
+
+#include <vector>
+#include <string>
+#include <RtypesCore.h>
+#include "CellID.h"
+
+using namespace std;
+
+// Layers and chips read out, from the Geometry block of the config or detected from the CellIDs of
+// Raw_Hit files. Per-cell arrays hold the memory cell 0 channels of the active layers only, Cells()
+// of them: Index() looks the layer up in a table, so layers missing in between cost nothing, and
+// FromIndex() gives the cell back. Maps by layer ID (the layer*chips+chip axis of the 2D summaries)
+// span Layers(), the highest active layer + 1.
+class Geometry
+{
+public:
+	static constexpr int n_channel = CellID::n_channel;
+
+	Geometry(const int layers=40,const int chips=9); // Layers 0..layers-1
+	Geometry(const vector<int> &active_layers,const int chips);
+
+	int Chips() const {return chips;}
+	int Layers() const {return active.empty() ? 0 : active.back()+1;}
+	const vector<int> &ActiveLayers() const {return active;}
+	bool Active(const int layer) const {return layer>=0 && layer<CellID::n_layer && layer_base[layer]>=0;}
+	int Cells() const {return (int)active.size()*chips*n_channel;}
+
+	// Dense index of a memory cell 0 channel, -1 outside the geometry
+	int Index(const CellID id) const
+	{
+		if(!id.Valid() || id.Memo()!=0 || id.Chip()>=chips)return -1;
+		const int base = layer_base[id.Layer()];
+		return base<0 ? -1 : base+id.Chip()*n_channel+id.Channel();
+	}
+	int IndexOf(const int decimal) const {return Index(CellID::FromDecimal(decimal));}
+	CellID FromIndex(const int index) const
+	{
+		const int per_layer = chips*n_channel;
+		return CellID(active[index/per_layer],(index%per_layer)/n_channel,0,index%n_channel);
+	}
+	string Describe() const; // "4 layers (0 1 2 3) x 9 chips"
+
+	// Layers and chips seen in the CellID branch of the first entries of every file (all if entries<0)
+	static Geometry Detect(const vector<string> &files,const Long64_t entries);
+
+private:
+	int chips;
+	vector<int> active; // Active layer IDs, ascending
+	int layer_base[CellID::n_layer]; // Index of the layer's first cell, -1 if the layer is not active
+
+	void Build(const vector<int> &active_layers,const int chips);
+};
+
+#endif
@@ -8,6 +8,7 @@
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <functional>
 
 using namespace std;
 
@@ -19,10 +20,21 @@ class HBase{
 
 		protected:
 				//Protected member functions
-				virtual void ReadTree(const TString &fname,const TString &tname); //Read TTree from ROOT files
+				virtual void ReadTree(const TString &fname,const TString &tname); //Read TTree from ROOT files, closing the previous one
 				virtual void ReadList(const string &_list); // Read the file list and save to the protected vector
+				static int DacChannel(const string &fname); // Channel injected in a DAC run, from "...chn<N>_..." in the file name, -1 if there is none
 				virtual void CreateFile(const TString &_outname); // Create output file
 				virtual void Init(const TString &_outname);// Initialize derived members
+				virtual Long64_t GetEntry(const Long64_t entry); // tin->GetEntry, widening the compact schema into the vectors below
+				// Tree reader: the branches in names (all if empty) are the only ones read and go through a TTreeCache
+				// of cache_size bytes, prefetched asynchronously when prefetch is set (for this reader's cache only)
+				int OpenTree(const TString &fname,const TString &tname,const vector<string> &names); // ReadTree + EnableBranches, 0 if the tree is missing
+				void EnableBranches(const vector<string> &names);
+				void CloseTree(); // Close and delete fin, the branch buffers go with it
+				void SetReadCache(const Long64_t bytes,const bool async_prefetch){cache_size = bytes; prefetch = async_prefetch;};
+				// Reads the entries from first on cluster by cluster, f is called after each GetEntry.
+				// Entries for which select returns false are not read. Returns the number of entries read.
+				Long64_t ForEachEntry(const function<void(Long64_t)> &f,const Long64_t first=0,const function<bool(Long64_t)> &select=nullptr);
 
 				// Protected member variables
 				vector<string>	list;
@@ -34,6 +46,7 @@ class HBase{
 				int   _cycleID;
 				int   _triggerID;
 				unsigned int   _Event_Time;
+				int   _Pedestal_Sample; // Pedestal_Sample of zero suppressed files, always read; 1 when the branch is missing
 				vector< int > *_cellID;
 				vector< int > *_bcid;
 				vector< int > *_hitTag;
@@ -42,6 +55,25 @@ class HBase{
 				vector< double > *_HG_Charge;
 				vector< double > *_LG_Charge;
 				vector< double > *_Hit_Time;
+				bool  b_compact; // Raw_Hit written with the compact schema
+				Long64_t cache_size; // TTreeCache of tin in bytes (default one decoder auto-flush cluster), 0 disables it
+				bool  prefetch;
+
+		private:
+				// Branches of the compact schema and the vectors they are widened into
+				vector< UShort_t > *_bcid16;
+				vector< Char_t > *_hitTag8;
+				vector< Char_t > *_gainTag8;
+				vector< Short_t > *_HG_Charge16;
+				vector< Short_t > *_LG_Charge16;
+				vector< Short_t > *_Hit_Time16;
+				bool b_read_compact[6]; // BCID, HitTag, GainTag, HG_Charge, LG_Charge, Hit_Time enabled
+				vector< int > _bcid_w;
+				vector< int > _hitTag_w;
+				vector< int > _gainTag_w;
+				vector< double > _HG_Charge_w;
+				vector< double > _LG_Charge_w;
+				vector< double > _Hit_Time_w;
 
 };
 
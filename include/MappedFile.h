@@ -0,0 +1,34 @@
+#ifndef MAPPEDFILE_HH
+#define MAPPEDFILE_HH
+
+#include <string>
+#include <cstddef>
+
+using namespace std;
+
+// Read-only memory mapping of a whole binary file.
+// The decoder parses event bags straight out of Data() without copying bytes.
+class MappedFile
+{
+public:
+	MappedFile();
+	virtual ~MappedFile();
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	int Open(const string &fname); // Map the file, return 0 if it can not be mapped
+	void Close();
+	void Release(const size_t offset); // Drop the pages before offset once they have been decoded
+	bool IsOpen() const {return _fd>=0;}
+	const unsigned char *Data() const {return _data;}
+	size_t Size() const {return _size;}
+
+private:
+	static const size_t release_step = 64UL<<20; // Give back consumed pages every 64 MB
+	int _fd;
+	unsigned char *_data;
+	size_t _size;
+	size_t _released;
+};
+
+#endif
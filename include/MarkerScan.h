@@ -0,0 +1,26 @@
+#ifndef MARKERSCAN_HH
+#define MARKERSCAN_HH
+
+#include <vector>
+#include <cstddef>
+
+using namespace std;
+
+// Frame markers of the .dat stream, see Doc/datastructure.md
+enum MarkerType {kEventBegin=0, kEventEnd, kSPIROCBegin, kSPIROCEnd, kMarkerTypes};
+const unsigned int marker_word[kMarkerTypes] = {0xfbeefbee,0xfeddfedd,0xfa5afa5a,0xfeeefeee};
+
+struct BagMarker
+{
+	size_t offset; // Byte offset of the first marker byte
+	int type;      // MarkerType
+};
+
+// Offset of the first marker of the given type in data[0,size), size if there is none
+size_t FindMarker(const unsigned char *data, const size_t size, const MarkerType type);
+// All markers of every type in data[0,size) in one pass, ascending offsets (overlapping ones included)
+void ScanMarkers(const unsigned char *data, const size_t size, vector<BagMarker> &markers);
+// Instruction set picked at runtime: "avx2", "sse2" or "scalar"
+const char *MarkerScanISA();
+
+#endif
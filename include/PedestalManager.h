@@ -2,6 +2,9 @@
 #define PEDESTALMANAGER_HH
 
 #include "HBase.h"
+#include "CellHistStore.h"
+#include "Geometry.h"
+#include "DatManager.h"
 #include <TH2D.h>
 #include <vector>
 #include <map>
@@ -18,9 +21,23 @@
 #include <thread>
 #include <utility>
 #include <chrono>
+#include <functional>
 
 using namespace std;
 
+class TF1;
+class TSpectrum;
+
+// Gaussian fit of one cell's pedestal: the last fit window and parameters
+struct PedestalFit
+{
+	double peak=0.;
+	double rms=0.;
+	double constant=0.;
+	double xmin=0.;
+	double xmax=0.;
+};
+
 class PedestalManager : public HBase{
 
 public:
@@ -37,14 +54,42 @@ public:
 	PedestalManager &operator=(PedestalManager const &) = delete;
 
 	void Init(const TString &_outname);
-	int AnaPedestal(const std::string &list,const int &sel_hittag);
+	int AnaPedestal(const std::string &list,const int &sel_hittag); // 1 once the pedestals are written, 0 on failure
 	void Setmt(bool mt){usemt = mt;};
+	void SetThreads(int n){nthreads = n;}; // File readers of the usemt and rdf engines, 0 means one per core
+	void SetMethod(const string &m){method = m;}; // fit, robust or compare
+	void SetEngine(const string &e){engine = e;}; // native, rdf (an RDataFrame per file, same cuts) or compare (both, bin by bin)
+	void SetMinimizer(const string &m){minimizer = m;}; // Of the fits, empty keeps ROOT's default; Minuit2 fits on nthreads
+	void SetGeometry(const Geometry &g,const Long64_t detect=0){geometry = g; detect_entries = detect;}; // detect!=0: Geometry::Detect on the list instead
+	// Fused pipeline: decoders feed their events through DecodedSink (one worker per concurrent
+	// decoder), FinishDecoded then fits and writes as AnaPedestal does. Init comes first.
+	// The sink of a file holds up to 9 events until their Event_Time is known to be complete.
+	// Every worker has its own counts, WorkerBytes of them (about 160 MB for 40 layers x 9 chips).
+	void StartDecoded(const int sel_hittag,const int workers);
+	static size_t WorkerBytes(const Geometry &g){return CellHistStore::Bytes(1500,g.Cells())+CellHistStore::Bytes(1600,g.Cells());}
+	EventSink DecodedSink(const string &dat_file,const int worker);
+	int FinishDecoded(); // As AnaPedestal
+
+	// Estimates of one cell from its counts, also used by the hbuana_pedestal_check program:
+	// FitCell is the TSpectrum window and Gaussian fits, RobustCell the closed form of the same windows,
+	// with TSpectrum's peak search written out
+	static PedestalFit FitCell(TH1D *h,TF1 *f1,TSpectrum *s);
+	static PedestalFit RobustCell(const uint32_t *counts,const int nbins);
+	// Robust against fit: a cell agrees when |dpeak| <= peak_tolerance[0] + peak_tolerance[1]*rms of the fit,
+	// and the same for |drms| with rms_tolerance. Prints a summary and the first cells outside, returns their number.
+	static constexpr double peak_tolerance[2] = {0.5,0.05};
+	static constexpr double rms_tolerance[2] = {0.5,0.10};
+	static int CompareCells(const char *name,const CellHistStore &hists,const vector<PedestalFit> &fits,const vector<PedestalFit> &robust,const function<int(int)> &cell_id);
 	
 private:
 	//using HBase::HBase;
-	mutex mtx;
 	bool usemt=0;
-	vector<int> vec_cellid;
+	int nthreads=10;
+	string method="fit";
+	string engine="native";
+	string minimizer="";
+	Geometry geometry;
+	Long64_t detect_entries=0;
 	std::unique_ptr<TH2D> highgainpeak;
 	std::unique_ptr<TH2D> highgainrms;
 	std::unique_ptr<TH2D> lowgainpeak;
@@ -53,15 +98,33 @@ private:
 	unordered_map<int,TH2D*> map_layer_lowgainrms;
 	unordered_map<int,TH2D*> map_layer_highgainpeak;
 	unordered_map<int,TH2D*> map_layer_highgainrms;
-	unordered_map<int,TH1D*> map_cellid_highgain;
-	unordered_map<int,TH1D*> map_cellid_lowgain;
+	CellHistStore hist_highgain; // Counts of every channel, TH1D are only made to fit and write
+	CellHistStore hist_lowgain;
+	vector<CellHistStore> worker_highgain; // Private counts of the pool and fused workers, merged by MergeWorkers
+	vector<CellHistStore> worker_lowgain;
+	int decoded_hittag=0;
+	vector<PedestalFit> fit_highgain; // By CellHistStore index, filled by FitCells
+	vector<PedestalFit> fit_lowgain;
 	double lowgain_min=1000.,lowgain_max=0.;
 	double highgain_min=1000.,highgain_max=0.;
 	//Branch Name
 	double highgain_peak=0.,highgain_rms=0.,lowgain_peak=0.,lowgain_rms=0.;
 	int _cellid;
 	
+	void Book(); // Count stores and 2D maps of the geometry
+	void MergeWorkers();
+	int WritePedestal(); // Fit or estimate every cell, write the tree, histograms and 2D maps
 	void SaveCanvas(TH2D* h,const TString &name);
+	// Fills with the PedestalSelection cuts, of one file into the given stores (throws if it cannot be read)
+	// or of the list, serially or on nthreads, 0 if a file failed
+	void FillFile(const string &file,const int sel_hittag,CellHistStore &highgain,CellHistStore &lowgain) const;
+	void FillFileRDF(const string &file,const int sel_hittag,CellHistStore &highgain,CellHistStore &lowgain) const;
+	int FillFiles(const int sel_hittag,const bool rdf);
+	int FillSerial(const int sel_hittag);
+	int CompareEngines(const int sel_hittag);
+	void FitCells();
+	void EstimateCells(vector<PedestalFit> &highgain,vector<PedestalFit> &lowgain); // method robust, on nthreads
+	int CompareEstimates(); // method compare: robust against the fits, cells outside the tolerances
 };
 
 extern PedestalManager *_instance;
@@ -0,0 +1,73 @@
+#ifndef PEDESTALSELECTION_HH
+#define PEDESTALSELECTION_HH
+
+#include "Geometry.h"
+#include "CellHistStore.h"
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// Cuts of the pedestal fill, one instance per file, shared by every engine of PedestalManager.
+// Events are given in file order. An event is complete when at least min_same_time events of the file
+// share its Event_Time; an incomplete one is skipped and every chip starts counting its hits again.
+// Zero suppressed events are not read but count as complete. A hit is used when it has the selected
+// HitTag, a cell of the geometry and is not the channel injected in a DAC run; its charges above
+// min_charge are filled once its chip has had more than 36 hits since the last incomplete event.
+class PedestalSelection
+{
+public:
+	static const int min_same_time = 10;
+	static constexpr double min_charge = 100.;
+
+	PedestalSelection(const Geometry &_geometry,const int _hittag,const int _dac_chn) :
+		geometry(_geometry),hittag(_hittag),dac_chn(_dac_chn),flag(_geometry.Cells()/Geometry::n_channel,0){}
+
+	// Per event of a file, whether it is complete
+	static vector<char> Complete(const vector<unsigned int> &event_time)
+	{
+		vector<unsigned int> sorted_time(event_time);
+		sort(sorted_time.begin(),sorted_time.end());
+		vector<char> complete(event_time.size());
+		for(size_t i=0;i<event_time.size();i++)
+		{
+			auto same_time = equal_range(sorted_time.begin(),sorted_time.end(),event_time[i]);
+			complete[i] = same_time.second-same_time.first>=min_same_time;
+		}
+		return complete;
+	}
+	// Every event in file order, true if its hits are to be given to Hit
+	bool Event(const bool complete,const bool sampled)
+	{
+		if(!complete)
+		{
+			fill(flag.begin(),flag.end(),0);
+			return false;
+		}
+		if(!sampled)
+		{
+			for(auto &f:flag)f=max(f,36);
+			return false;
+		}
+		return true;
+	}
+	void Hit(const int hit_tag,const int cellid,const double highgain,const double lowgain,CellHistStore &hist_highgain,CellHistStore &hist_lowgain)
+	{
+		if(hit_tag!=hittag)return;
+		const CellID id = CellID::FromDecimal(cellid);
+		const int index = geometry.Index(id);
+		if(index<0)return;
+		if(dac_chn==id.Channel())return;
+		if(++flag[index/Geometry::n_channel]<=36)return;
+		if(highgain>min_charge)hist_highgain.Fill(index,highgain);
+		if(lowgain>min_charge)hist_lowgain.Fill(index,lowgain);
+	}
+
+private:
+	const Geometry &geometry;
+	int hittag;
+	int dac_chn;
+	vector<int> flag; // Hits per chip, by index/36
+};
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef PREFIXLINEFIT_HH
+#define PREFIXLINEFIT_HH
+
+#include "SparseHist2D.h"
+#include <vector>
+
+using namespace std;
+
+// Straight line x = slope*y + intercept through the entries of a range of x columns
+struct LineFit
+{
+	double slope=0.;
+	double intercept=0.;
+	double chi2=0.; // Sum of the squared x residuals
+	double ndf=0.;  // Entries - 2
+	double Chi2NDF() const; // Variance of the x residuals, in x units squared
+};
+
+// Least squares line x = slope*y + intercept through the in-range bins of a SparseHist2D, every entry a
+// point (x,y) at its bin centres with unit weight. x is fitted on y so that for the HG (x) vs LG (y)
+// calibration histograms the slope is HG/LG. The column sums are accumulated once into prefix sums over
+// x, so the line, chi2 and NDF of any range of columns cost O(1).
+class PrefixLineFit
+{
+public:
+	PrefixLineFit(const SparseHist2D &h);
+	virtual ~PrefixLineFit(){};
+
+	LineFit Fit(const double xmin,const double xmax) const; // Columns from the bin of xmin to the bin of xmax, as TH1::Fit
+
+private:
+	const SparseHist2D &hist;
+	// Prefix sums up to and including column b, index b (0..nx+1)
+	vector<double> w,wx,wy,wxx,wxy,wyy;
+};
+
+#endif
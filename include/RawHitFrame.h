@@ -0,0 +1,39 @@
+#ifndef RAWHITFRAME_HH
+#define RAWHITFRAME_HH
+
+#include <ROOT/RDataFrame.hxx>
+#include <vector>
+#include <string>
+
+using namespace std;
+
+// Raw_Hit of a whole file list as one RDataFrame with implicit multithreading, the rdf engine of
+// PedestalManager and DacManager. Node() has the tree branches and
+//   file_index   position of the entry's file in the list (the event loop throws if the name does not match)
+//   file_entry   entry number inside that file, entries below skip_entries are filtered out
+//   hittag       HitTag as RVec<int>
+//   hg, lg       HG_Charge and LG_Charge as RVec<double>
+// so the default and the compact schema are read the same way (the default branches are only aliased).
+// Fills go through ForeachSlot into per-slot results, Slots() of them. Implicit multithreading is only on
+// while a frame that switched it on exists; with threads 1 (and no other frame) the entries come in file order.
+class RawHitFrame
+{
+public:
+	RawHitFrame(const vector<string> &files,const int threads,const ULong64_t skip_entries=0);
+	virtual ~RawHitFrame();
+	RawHitFrame(const RawHitFrame &) = delete;
+	RawHitFrame &operator=(const RawHitFrame &) = delete;
+
+	ROOT::RDF::RNode Node(){return node;}
+	unsigned int Slots() const {return nslots;}
+
+private:
+	vector<string> files;
+	vector<ULong64_t> next_entry; // Per slot, entry number of the next entry in the slot's current file
+	bool own_mt; // Implicit multithreading switched on by this frame
+	unsigned int nslots;
+	ROOT::RDataFrame df;
+	ROOT::RDF::RNode node;
+};
+
+#endif
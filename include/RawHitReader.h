@@ -0,0 +1,28 @@
+#ifndef RAWHITREADER_HH
+#define RAWHITREADER_HH
+
+#include "HBase.h"
+
+using namespace std;
+
+// Raw_Hit reader of one file with the branches the Pedestal and Calibration fills use, owned by a
+// single pool task (PedestalManager file fills, DacManager file ingestion, Geometry::Detect)
+class RawHitReader : public HBase
+{
+public:
+	int Open(const string &fname,const vector<string> &branches={"CellID","HitTag","HG_Charge","LG_Charge"})
+	{
+		return OpenTree(TString(fname.c_str()),"Raw_Hit",branches);
+	}
+	using HBase::ForEachEntry;
+	using HBase::EnableBranches;
+	using HBase::SetReadCache;
+	unsigned int EventTime() const {return _Event_Time;}
+	const vector<int> &CellID() const {return *_cellID;}
+	const vector<int> &HitTag() const {return *_hitTag;}
+	const vector<double> &HG_Charge() const {return *_HG_Charge;}
+	const vector<double> &LG_Charge() const {return *_LG_Charge;}
+	bool PedestalSample() const {return _Pedestal_Sample!=0;} // Written with every channel (always, unless zero suppressed)
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef SPARSEHIST2D_HH
+#define SPARSEHIST2D_HH
+
+#include <TH2D.h>
+#include <unordered_map>
+#include <cstdint>
+
+using namespace std;
+
+// Unit-weight fills of a TH2D(nx,xlow,xup,ny,ylow,yup) kept as counts of the bins that were hit only.
+// MakeTH2 gives the TH2D the same Fill calls would have made: contents, entries and statistics.
+class SparseHist2D
+{
+public:
+	SparseHist2D(const int _nx=1,const double _xlow=0.,const double _xup=1.,const int _ny=1,const double _ylow=0.,const double _yup=1.);
+	virtual ~SparseHist2D(){};
+	SparseHist2D(const SparseHist2D &) = default;
+	SparseHist2D(SparseHist2D &&) = default;
+	SparseHist2D &operator=(const SparseHist2D &) = default;
+	SparseHist2D &operator=(SparseHist2D &&) = default;
+
+	void Fill(const double x,const double y)
+	{
+		const int binx = Bin(x,nx,xlow,xup);
+		const int biny = Bin(y,ny,ylow,yup);
+		counts[binx+(nx+2)*biny]++;
+		entries++;
+		if(binx==0 || binx>nx || biny==0 || biny>ny)return; // TH2 keeps no statistics of under/overflows
+		stats[0]++;
+		stats[1]++;
+		stats[2]+=x;
+		stats[3]+=x*x;
+		stats[4]+=y;
+		stats[5]+=y*y;
+		stats[6]+=x*y;
+	}
+	void Add(const SparseHist2D &other); // Same binning
+	size_t Size() const {return counts.size();} // Bins with counts
+	int BinsX() const {return nx;}
+	int BinsY() const {return ny;}
+	int FindBinX(const double x) const {return Bin(x,nx,xlow,xup);}
+	double CenterX(const int binx) const {return xlow+(binx-0.5)*(xup-xlow)/nx;}
+	double CenterY(const int biny) const {return ylow+(biny-0.5)*(yup-ylow)/ny;}
+	template <class F> void ForEachBin(F f) const // f(binx,biny,count) for the bins with counts, in no particular order
+	{
+		for(auto &c:counts)f(c.first%(nx+2),c.first/(nx+2),c.second);
+	}
+	TH2D *MakeTH2(const TString &name) const; // New TH2D(name,name,...) in the current directory
+
+private:
+	int nx;
+	double xlow;
+	double xup;
+	int ny;
+	double ylow;
+	double yup;
+	unordered_map<int,uint32_t> counts; // Global bin as in TH2D::GetBin
+	double entries;
+	double stats[7]; // TH2::GetStats order: sumw, sumw2, sumwx, sumwx2, sumwy, sumwy2, sumwxy
+
+	// TAxis::FindFixBin
+	static int Bin(const double v,const int n,const double low,const double up)
+	{
+		if(v<low)return 0;
+		if(!(v<up))return n+1;
+		return 1+int(n*(v-low)/(up-low));
+	}
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef STAGESCHEDULER_HH
+#define STAGESCHEDULER_HH
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <sys/types.h>
+
+using namespace std;
+
+// Runs the blocks of the config (DAT-ROOT, Pedestal Cosmic/DAC, Calibration Cosmic/DAC) as stages.
+// A stage lists the files it needs and makes, and waits for every earlier stage making one of them;
+// the others are independent. In parallel mode the ready stages are started together, each in its
+// own process (the managers share ROOT globals and the PedestalManager instance), with a slice of
+// the thread budget, so the chain takes its critical path instead of the sum of the stages.
+// Otherwise the stages run one after another in this process, in the order they were added.
+class StageScheduler
+{
+public:
+	// A stage runs with the number of threads it was given, 0 meaning its own settings, and returns 1 on success
+	using Task = function<int(const int threads)>;
+
+	StageScheduler(const bool parallel,const int threads); // threads: shared budget, 0 means one per core
+
+	void Add(const string &name,const vector<string> &needs,const vector<string> &makes,Task task); // Files compared after Normalize
+	static string Normalize(const string &path); // Same string for every spelling of a path, ./a.root and a.root alike
+	int Run(); // 1 if every stage succeeded
+
+private:
+	enum State {pending,running,done,failed};
+	struct Stage
+	{
+		string name;
+		vector<string> needs,makes;
+		Task task;
+		vector<size_t> after; // Earlier stages making a file this one needs or makes too
+		State state=pending;
+		int threads=0;
+		pid_t pid=0;
+		double start=0,elapsed=0;
+	};
+	vector<Stage> stages;
+	bool parallel;
+	int budget;
+
+	int RunSerial();
+	int RunParallel();
+	void Launch(Stage &stage,const int threads);
+	void PrintTimes(const double total) const;
+};
+
+#endif
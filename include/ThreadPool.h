@@ -0,0 +1,53 @@
+#ifndef THREADPOOL_HH
+#define THREADPOOL_HH
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+using namespace std;
+
+// Fixed-size work-stealing pool.
+// Tasks are dealt round-robin to per-worker queues in submission order, every worker
+// takes from the front of its own queue and steals from the back of the others when idle.
+class ThreadPool
+{
+public:
+	ThreadPool(const int nthreads);
+	virtual ~ThreadPool();
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	void Submit(function<void()> task);
+	void Wait(); // Block until every submitted task has finished
+	int Size() const {return workers.size();}
+	static int WorkerIndex(); // Index of the calling worker thread, -1 outside the pool
+	static int Resolve(const int nthreads); // 0 or negative means one thread per core
+
+private:
+	struct TaskQueue
+	{
+		mutex m;
+		deque< function<void()> > tasks;
+	};
+	vector< unique_ptr<TaskQueue> > queues;
+	vector< thread > workers;
+	atomic<size_t> next_queue;
+	atomic<long> queued;  // Tasks waiting in the queues
+	atomic<long> pending; // Tasks submitted and not finished
+	mutex m_sleep;
+	condition_variable cv_task;
+	mutex m_done;
+	condition_variable cv_done;
+	bool stop;
+
+	void Work(const int index);
+	bool Pop(const int index, function<void()> &task);
+};
+
+#endif
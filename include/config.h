@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include "yaml-cpp/yaml.h"
+#include "Geometry.h"
 
 using namespace std;
 
@@ -18,7 +19,16 @@ public:
 
 	virtual void Print();
 	virtual void Parse(const string config_file);
-	virtual int Run();
+	virtual int Run(); // Every block switched on is a stage of a StageScheduler
+
+private:
+	Geometry geometry;
+	Long64_t detect_entries=0; // Entries read to detect the geometry, 0: use the Geometry block
+
+	// Stages, threads>0 replaces the thread settings of the block
+	int RunDat(const int threads);
+	int RunPedestal(const string &block,const int threads);
+	int RunCalibration(const string &block,const int threads);
 };
 
 
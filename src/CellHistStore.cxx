@@ -0,0 +1,63 @@
+#include "CellHistStore.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+using namespace std;
+
+CellHistStore::CellHistStore(const int _nbins,const int _n_cell) : nbins(_nbins),n_cell(_n_cell)
+{
+	counts.assign((size_t)n_cell*(nbins+2),0);
+}
+
+int CellHistStore::WorkersInMemory(const int wanted,const size_t bytes_each)
+{
+	// MemAvailable counts the page cache that can be dropped, free pages alone would be too strict
+	size_t available = 0;
+	ifstream meminfo("/proc/meminfo");
+	string key;
+	size_t kb;
+	while(meminfo>>key>>kb)
+	{
+		if(key=="MemAvailable:"){available = kb*1024;break;}
+		meminfo.ignore(256,'\n');
+	}
+	if(available==0)available = (size_t)sysconf(_SC_AVPHYS_PAGES)*sysconf(_SC_PAGESIZE);
+	if(available==0 || bytes_each==0)return max(1,wanted);
+	const int fit = max<size_t>(1,available/2/bytes_each);
+	if(fit>=wanted)return max(1,wanted);
+	cout<<"Private count stores of "<<bytes_each/1048576<<" MB: "<<fit<<" workers instead of "<<wanted<<" fit in half of the "<<available/1048576<<" MB available"<<endl;
+	return fit;
+}
+
+void CellHistStore::Add(const CellHistStore &other)
+{
+	for(size_t i=0;i<counts.size();i++) counts[i] += other.counts[i];
+}
+
+void CellHistStore::Clear()
+{
+	fill(counts.begin(),counts.end(),0);
+}
+
+void CellHistStore::CopyTo(TH1D *h,const int index) const
+{
+	const uint32_t *c = Counts(index);
+	double entries = 0.;
+	for(int bin=0;bin<nbins+2;bin++)
+	{
+		h->SetBinContent(bin,c[bin]);
+		entries += c[bin];
+	}
+	h->SetEntries(entries);
+}
+
+TH1D *CellHistStore::MakeTH1(const int index,const TString &name) const
+{
+	TH1D *h = new TH1D(name,name,nbins,0,nbins);
+	h->SetDirectory(0);
+	CopyTo(h,index);
+	return h;
+}
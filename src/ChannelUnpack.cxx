@@ -0,0 +1,205 @@
+#include "ChannelUnpack.h"
+#include "CellID.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHANNELUNPACK_X86
+#endif
+
+using namespace std;
+
+// Word layout: TDC word = gainTag_tdc(0x2000) | hit(0x1000) | tdc(0x0fff),
+//              ADC word = gain(0x2000) | adc(0x0fff).
+// The vector kernels process 8 (sse2) or 16 (avx2) channels per step; the last step overlaps
+// the previous one so 36 channels need no scalar tail.
+namespace{
+	const int n_ch = 36;
+
+	void UnpackCell_scalar(const unsigned char *cell, const bool b_auto_gain, const CellColumns &out)
+	{
+		for(int i=0;i<n_ch;i++)
+		{
+			const int t = cell[2*i]<<8 | cell[2*i+1];
+			const int a = cell[2*(i+n_ch)]<<8 | cell[2*(i+n_ch)+1];
+			const int tdc = t&0x0fff;
+			const int adc = a&0x0fff;
+			const int gain = (a>>13)&1;
+			out.hitTag[i] = (t>>12)&1;
+			out.gainTag_tdc[i] = (t>>13)&1;
+			if(b_auto_gain){
+				out.gainTag[i] = gain;
+				out.HG_Charge[i] = gain ? adc : -1;
+				out.LG_Charge[i] = gain ? -1 : adc;
+				out.Hit_Time[i] = tdc;
+			}
+			else{
+				out.gainTag[i] = -1;
+				out.HG_Charge[i] = tdc;
+				out.LG_Charge[i] = adc;
+				out.Hit_Time[i] = -1;
+			}
+		}
+	}
+
+#ifdef CHANNELUNPACK_X86
+	__attribute__((target("sse2")))
+	inline __m128i Swap16_sse2(const __m128i v)
+	{
+		return _mm_or_si128(_mm_slli_epi16(v,8),_mm_srli_epi16(v,8));
+	}
+
+	// Sign-extend 8 int16 to int32 and store them, plus their double values if d is set
+	__attribute__((target("sse2")))
+	inline void Store8_sse2(const __m128i v, int *i32, double *d)
+	{
+		const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v,v),16);
+		const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v,v),16);
+		if(i32){
+			_mm_storeu_si128((__m128i*)i32,lo);
+			_mm_storeu_si128((__m128i*)(i32+4),hi);
+		}
+		if(d){
+			_mm_storeu_pd(d,_mm_cvtepi32_pd(lo));
+			_mm_storeu_pd(d+2,_mm_cvtepi32_pd(_mm_shuffle_epi32(lo,0x4e)));
+			_mm_storeu_pd(d+4,_mm_cvtepi32_pd(hi));
+			_mm_storeu_pd(d+6,_mm_cvtepi32_pd(_mm_shuffle_epi32(hi,0x4e)));
+		}
+	}
+
+	__attribute__((target("sse2")))
+	void UnpackCell_sse2(const unsigned char *cell, const bool b_auto_gain, const CellColumns &out)
+	{
+		const __m128i one = _mm_set1_epi16(1);
+		const __m128i m12 = _mm_set1_epi16(0x0fff);
+		const __m128i minus1 = _mm_set1_epi16(-1);
+		static const int step[5] = {0,8,16,24,28};
+		for(int k=0;k<5;k++)
+		{
+			const int i = step[k];
+			const __m128i t = Swap16_sse2(_mm_loadu_si128((const __m128i*)(cell+2*i)));
+			const __m128i a = Swap16_sse2(_mm_loadu_si128((const __m128i*)(cell+2*(i+n_ch))));
+			const __m128i tdc = _mm_and_si128(t,m12);
+			const __m128i adc = _mm_and_si128(a,m12);
+			Store8_sse2(_mm_and_si128(_mm_srli_epi16(t,12),one),out.hitTag+i,nullptr);
+			Store8_sse2(_mm_and_si128(_mm_srli_epi16(t,13),one),out.gainTag_tdc+i,nullptr);
+			if(b_auto_gain){
+				const __m128i gain = _mm_and_si128(_mm_srli_epi16(a,13),one);
+				const __m128i high = _mm_cmpeq_epi16(gain,one);
+				Store8_sse2(gain,out.gainTag+i,nullptr);
+				Store8_sse2(_mm_or_si128(adc,_mm_andnot_si128(high,minus1)),nullptr,out.HG_Charge+i);
+				Store8_sse2(_mm_or_si128(adc,high),nullptr,out.LG_Charge+i);
+				Store8_sse2(tdc,nullptr,out.Hit_Time+i);
+			}
+			else{
+				Store8_sse2(minus1,out.gainTag+i,out.Hit_Time+i);
+				Store8_sse2(tdc,nullptr,out.HG_Charge+i);
+				Store8_sse2(adc,nullptr,out.LG_Charge+i);
+			}
+		}
+	}
+
+	__attribute__((target("avx2")))
+	inline __m256i Swap16_avx2(const __m256i v)
+	{
+		return _mm256_or_si256(_mm256_slli_epi16(v,8),_mm256_srli_epi16(v,8));
+	}
+
+	__attribute__((target("avx2")))
+	inline void Store16_avx2(const __m256i v, int *i32, double *d)
+	{
+		const __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(v));
+		const __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(v,1));
+		if(i32){
+			_mm256_storeu_si256((__m256i*)i32,lo);
+			_mm256_storeu_si256((__m256i*)(i32+8),hi);
+		}
+		if(d){
+			_mm256_storeu_pd(d,_mm256_cvtepi32_pd(_mm256_castsi256_si128(lo)));
+			_mm256_storeu_pd(d+4,_mm256_cvtepi32_pd(_mm256_extracti128_si256(lo,1)));
+			_mm256_storeu_pd(d+8,_mm256_cvtepi32_pd(_mm256_castsi256_si128(hi)));
+			_mm256_storeu_pd(d+12,_mm256_cvtepi32_pd(_mm256_extracti128_si256(hi,1)));
+		}
+	}
+
+	__attribute__((target("avx2")))
+	void UnpackCell_avx2(const unsigned char *cell, const bool b_auto_gain, const CellColumns &out)
+	{
+		const __m256i one = _mm256_set1_epi16(1);
+		const __m256i m12 = _mm256_set1_epi16(0x0fff);
+		const __m256i minus1 = _mm256_set1_epi16(-1);
+		static const int step[3] = {0,16,20};
+		for(int k=0;k<3;k++)
+		{
+			const int i = step[k];
+			const __m256i t = Swap16_avx2(_mm256_loadu_si256((const __m256i*)(cell+2*i)));
+			const __m256i a = Swap16_avx2(_mm256_loadu_si256((const __m256i*)(cell+2*(i+n_ch))));
+			const __m256i tdc = _mm256_and_si256(t,m12);
+			const __m256i adc = _mm256_and_si256(a,m12);
+			Store16_avx2(_mm256_and_si256(_mm256_srli_epi16(t,12),one),out.hitTag+i,nullptr);
+			Store16_avx2(_mm256_and_si256(_mm256_srli_epi16(t,13),one),out.gainTag_tdc+i,nullptr);
+			if(b_auto_gain){
+				const __m256i gain = _mm256_and_si256(_mm256_srli_epi16(a,13),one);
+				const __m256i high = _mm256_cmpeq_epi16(gain,one);
+				Store16_avx2(gain,out.gainTag+i,nullptr);
+				Store16_avx2(_mm256_or_si256(adc,_mm256_andnot_si256(high,minus1)),nullptr,out.HG_Charge+i);
+				Store16_avx2(_mm256_or_si256(adc,high),nullptr,out.LG_Charge+i);
+				Store16_avx2(tdc,nullptr,out.Hit_Time+i);
+			}
+			else{
+				Store16_avx2(minus1,out.gainTag+i,out.Hit_Time+i);
+				Store16_avx2(tdc,nullptr,out.HG_Charge+i);
+				Store16_avx2(adc,nullptr,out.LG_Charge+i);
+			}
+		}
+	}
+#endif
+
+	struct UnpackKernel
+	{
+		void (*unpack)(const unsigned char*,const bool,const CellColumns&);
+		const char *isa;
+	};
+
+	UnpackKernel SelectKernel()
+	{
+#ifdef CHANNELUNPACK_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) return {UnpackCell_avx2,"avx2"};
+		if(__builtin_cpu_supports("sse2")) return {UnpackCell_sse2,"sse2"};
+#endif
+		return {UnpackCell_scalar,"scalar"};
+	}
+
+	const UnpackKernel &Kernel()
+	{
+		static const UnpackKernel kernel = SelectKernel();
+		return kernel;
+	}
+
+	// Decimal CellID of memory cell 0, channel counted down from 35 in readout order
+	struct CellIDTable
+	{
+		int id[CellID::n_layer][CellID::n_chip][n_ch];
+		CellIDTable()
+		{
+			for(int layer=0;layer<CellID::n_layer;layer++)
+				for(int chip=0;chip<CellID::n_chip;chip++)
+					for(int i=0;i<n_ch;i++) id[layer][chip][i] = CellID(layer,chip,0,n_ch-1-i).Decimal();
+		}
+	};
+}
+
+void UnpackCell(const unsigned char *cell, const bool b_auto_gain, const CellColumns &out)
+{
+	Kernel().unpack(cell,b_auto_gain,out);
+}
+
+const int *CellIDRow(const int layer, const int chip)
+{
+	static const CellIDTable table;
+	return table.id[layer][chip];
+}
+
+const char *ChannelUnpackISA()
+{
+	return Kernel().isa;
+}
@@ -4,8 +4,20 @@
 #include <iostream>
 #include <TCanvas.h>
 #include <sstream>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include "RawHitFrame.h"
+#include "PrefixLineFit.h"
+#include "RawHitReader.h"
+#include "ThreadPool.h"
+#include "FitScope.h"
+#include <algorithm>
+#include <exception>
+#include <cmath>
 
 using namespace std;
+using ROOT::VecOps::RVec;
 
 DacManager::DacManager(const TString &outname)
 {
@@ -22,9 +34,6 @@ DacManager::DacManager(const TString &outname)
 	list.clear();
 	tout->Branch("cellid",&_cellid);
 	tout->Branch("slope",&_slope);
-	hdacslope=new TH2D("hdacslope","HighGain/LowGain",360,0,360,36,0,36);
-	hfit=new TH2D("hfit","Fitting Goodness",360,0,360,36,0,36);
-	hhighgain_platform=new TH2D("hhighgain_platform","High Gain Platform",360,0,360,36,0,36);
 	f1 = new TF1("f1","[0]*x+[1]"); // Function used to fit the slope (High_gain / Low_gain)
 	f2 = new TF1("f2","[0]"); // Function used to fetch the high gain platform
 	//cout<<"Initialization done"<<endl;
@@ -33,8 +42,13 @@ DacManager::DacManager(const TString &outname)
 void DacManager::SetPedestal(const TString &pedname)
 {
 	TFile *ftmp=TFile::Open(TString(pedname));
-	TH2D *htmp_high=(TH2D*)ftmp->Get("highgainpeak");
-	TH2D *htmp_low=(TH2D*)ftmp->Get("lowgainpeak");
+	TH2D *htmp_high=ftmp ? (TH2D*)ftmp->Get("highgainpeak") : nullptr;
+	TH2D *htmp_low=ftmp ? (TH2D*)ftmp->Get("lowgainpeak") : nullptr;
+	if(!htmp_high || !htmp_low)
+	{
+		cout<<"cant read the pedestal maps of "<<pedname<<endl;
+		return;
+	}
 	hped_high=(TH2D*)htmp_high->Clone("hped_high");
 	hped_low=(TH2D*)htmp_low->Clone("hped_low");
 	//ftmp->Close();
@@ -42,188 +56,134 @@ void DacManager::SetPedestal(const TString &pedname)
 int DacManager::AnaDac(const std::string &list,const TString &mode)
 {
 	//Initialization 
-	for(int i=0;i<40;i++)
+	ReadList(list);
+	if(this->list.empty())
+	{
+		cout<<"no files in "<<list<<endl;
+		return 0;
+	}
+	if(detect_entries!=0)geometry=Geometry::Detect(this->list,detect_entries);
+	Book(mode);
+	const int filled = engine=="rdf" ? FillRDF(mode) : FillFiles(mode);
+	if(!filled)
+	{
+		cout<<"Calibration fill failed, nothing written"<<endl;
+		return 0;
+	}
+	cout<<"Fill histogram done"<<endl;
+	return WriteCalib();
+}
+
+void DacManager::Book(const TString &mode)
+{
+	cout<<"Calibration geometry: "<<geometry.Describe()<<endl;
+	calib_mode = mode;
+	b_dac = mode=="dac";
+	b_cosmic = mode=="cosmic";
+	const int chips = geometry.Chips();
+	const int nx = geometry.Layers()*chips;
+	hdacslope=new TH2D("hdacslope","HighGain/LowGain",nx,0,nx,36,0,36);
+	hfit=new TH2D("hfit","Fitting Goodness",nx,0,nx,36,0,36);
+	hhighgain_platform=new TH2D("hhighgain_platform","High Gain Platform",nx,0,nx,36,0,36);
+	for(int i:geometry.ActiveLayers())
 	{
 		TString name_dacslope="hdacslope_"+TString(to_string(i).c_str());
 		TString name_fit="hfit_"+TString(to_string(i).c_str());
 		TString name_highgainplatform="hhighgainplatform_"+TString(to_string(i).c_str());
-		map_layer_dacslope[i]=new TH2D(name_dacslope,name_dacslope,9,0,9,36,0,36);
-		map_layer_fit[i]=new TH2D(name_fit,name_fit,9,0,9,36,0,36);
-		map_layer_highgainplatform[i]=new TH2D(name_highgainplatform,name_highgainplatform,9,0,9,36,0,36);
-	}
-	for(int l=0;l<40;l++)
-	{
-		for(int c=0;c<9;c++)
-		{
-			for(int chn=0;chn<36;chn++)
-			{
-				int tmp_cellid=l*1e5+c*1e4+chn;
-				TString tmp_name="hdac_"+TString(to_string(tmp_cellid).c_str());
-				if(mode=="dac")map_cellid_calib[tmp_cellid]=new TH2D(tmp_name,tmp_name,200,0,3400,200,0,500); // input high gain
-				else if(mode=="cosmic")map_cellid_calib[tmp_cellid]=new TH2D(tmp_name,tmp_name,700,0,3500,700,0,3500); // input high gain
-			}
-		}
+		map_layer_dacslope[i]=new TH2D(name_dacslope,name_dacslope,chips,0,chips,36,0,36);
+		map_layer_fit[i]=new TH2D(name_fit,name_fit,chips,0,chips,36,0,36);
+		map_layer_highgainplatform[i]=new TH2D(name_highgainplatform,name_highgainplatform,chips,0,chips,36,0,36);
 	}
+	// Cells are accumulated sparsely from their first hit on, the TH2Ds are made one at a time for the fits
+	cell_calib.clear();
+	cell_calib.resize(geometry.Cells());
+	if(mode=="dac")calib_empty=SparseHist2D(200,0,3400,200,0,500); // input high gain
+	else if(mode=="cosmic")calib_empty=SparseHist2D(700,0,3500,700,0,3500); // input high gain
 	cout<<"Ana preparation done"<<endl;
 	// ReadList(list);
+}
 
-	input_list = list;
-	ifstream data(input_list);
-	while(!data.eof())
+// Fit every cell and write the histograms, tree and maps
+int DacManager::WriteCalib()
+{
+	if(!fout || fout->IsZombie())
 	{
-		string tmp;
-		data>>tmp;
-		if(tmp=="")continue;
-		cout<<tmp<<endl;
-		int int_input_dac = -1;
-		int sel_channel = -1;
-		string input_dac = tmp;
-		string skipchannel = tmp;
-		if(mode=="dac")
-		{
-			skipchannel = skipchannel.substr(skipchannel.find_last_of('/')+1);
-			skipchannel = skipchannel.substr(skipchannel.find("chn")+3);
-			skipchannel = skipchannel.substr(0,skipchannel.find_last_of('_'));
-			sel_channel = stoi(skipchannel);
-			input_dac = input_dac.substr(input_dac.find_last_of('/')+1);
-			input_dac = input_dac.substr(input_dac.find("dac")+3);
-			input_dac = input_dac.substr(0,input_dac.find_last_of('.'));
-			int_input_dac = stoi(input_dac);
-		}
-		//cout<<skipchn<<endl;
-		this->ReadTree(TString(tmp.c_str()),"Raw_Hit");
-		int Nentry = tin->GetEntries();
-		for(int ientry=0;ientry<Nentry;ientry++)
-		{
-			if(ientry<5)continue; // Skip the first 5 events from Hao Liu
-			tin->GetEntry(ientry);
-			for(int i=0;i<_hitTag->size();i++)
-			{
-				if(mode=="dac" && _hitTag->at(i)!=1)continue; // For DAC we set =1 , for cosmic rays we skip 0
-				if(mode=="cosmic" && _hitTag->at(i)==0)continue; // For DAC we set =1 for cosmic rays we skip 0
-				int cellid = _cellID->at(i);
-				int channel = cellid%100;
-				int memo = (cellid%10000)/100;
-				if(memo != 0)continue;
-				if(mode == "dac" && channel!=sel_channel)continue; // if channel number != dac channel, skip it!
-				if(map_cellid_exist[cellid]==0)
-				{
-					vec_cellid.push_back(cellid);
-					map_cellid_exist[cellid]=1;
-				}
-				int layer = cellid/1e5;
-				int chip = (cellid%100000)/10000;
-				double tmp_lowgain=_LG_Charge->at(i);//-hped_low->GetBinContent(layer*9+chip+1,channel+1);
-				double tmp_highgain=_HG_Charge->at(i);//-hped_high->GetBinContent(layer*9+chip+1,channel+1);
-				// if(tmp_highgain<time_min)time_min=tmp_highgain;
-				// if(tmp_highgain>time_max)time_max=tmp_highgain;
-				// if(tmp_lowgain<charge_min)charge_min=tmp_lowgain;
-				// if(tmp_lowgain>charge_max)charge_max=tmp_lowgain;
-				//if(!map_cellid_calib[cellid])
-				//{
-				//	TString tmp_name="hdac_"+TString(to_string(cellid));
-				//	//if(mode=="dac")map_cellid_calib[cellid]=new TH2D(tmp_name,tmp_name,200,-200,300,200,-100,3400); // input high gain
-				//	//else if(mode=="cosmic")map_cellid_calib[cellid]=new TH2D(tmp_name,tmp_name,200,-100,3000,200,-200,3200); // input high gain
-				//}
-				map_cellid_calib[cellid]->Fill(tmp_highgain,tmp_lowgain); // Fill low gain high gain with pedestal subtracted
-			}
-
-		}
-		//fin->Close();
-		//delete fin;
+		cout<<"cant write the calibration output"<<endl;
+		return 0;
 	}
-	cout<<"Fill histogram done"<<endl;
+	const TString mode = calib_mode;
+	const int chips = geometry.Chips();
 	// cout<<"time min: "<<time_min<<" max: "<<time_max<<endl;
 	// cout<<"charge min: "<<charge_min<<" max: "<<charge_max<<endl;
 	fout->mkdir("calib");
 	cout<<"-------------"<<endl;
 	//fout->cd("calib");
 	// for(int i=0;i<40;i++)gDirectory->mkdir(TString("layer_")+TString(to_string(i).c_str()));
-	for(int i=0;i<40;i++)fout->mkdir("calib/"+TString("layer_")+TString(to_string(i).c_str()));
+	for(int i:geometry.ActiveLayers())fout->mkdir("calib/"+TString("layer_")+TString(to_string(i).c_str()));
 	//for(auto i:map_cellid_calib)
 	cout<<"Fitting"<<endl;
-	for_each(map_cellid_calib.begin(),map_cellid_calib.end(),[this,mode](pair<int,TH2D*> i)
+	size_t sparse_bins=0;
+	for(auto &calib:cell_calib)if(calib)sparse_bins+=calib->Size();
+	cout<<vec_cellid.size()<<" cells hit, "<<sparse_bins<<" bins filled"<<endl;
+	// Cells are fitted on a pool, every worker with its own copy of f1. The fitted histograms and
+	// results of a block of cells are written by this thread alone, in cell order, before the next block.
+	ROOT::EnableThreadSafety();
 	{
-		int cellid=i.first;
-		int layer = cellid/1e5;
-		int channel = cellid%100;
-		int chip = (cellid%100000)/10000;
-		double fit_goodness = 10000.; // Initialize a large fit value
-		bool fit_goodvalue_found=false,found_start=false;
-		double fitstart=100.,fitend=3000.;
-		double highgain_platform = 10000.;
-		double slope = -10.; // Slope after fitting
-		if(mode == "dac")
+		// The minimizer and TH1::AddDirectory are back as they were once the pool is gone
+		FitScope scope(minimizer,nthreads,"Calibration");
+		ThreadPool pool(scope.Workers());
+		cout<<"Calibration fit threads: "<<pool.Size()<<endl;
+		vector< unique_ptr<TF1> > worker_f1(pool.Size());
+		for(int w=0;w<pool.Size();w++)worker_f1[w].reset((TF1*)f1->Clone("f1"));
+		const size_t block = 4*pool.Size();
+		const size_t n_cell = geometry.Cells();
+		int n_disagree = 0;
+		for(size_t first=0;first<n_cell;first+=block) // Every cell, in Geometry::Index order
 		{
-			fitstart = 0.;
-			fitend = 3000.;
-		}
-		i.second->Fit("f1","q","",fitstart,fitend);
-		double fg0 = f1->GetChisquare()/f1->GetNDF(); //Fit goodness at largest range
-		for(int xmax=fitend;xmax>=0;xmax-=50) // TODO
-		{
-			i.second->Fit("f1","q","",fitstart,xmax);
-			fit_goodness = f1->GetChisquare()/f1->GetNDF();
-			slope = f1->GetParameter(0); // Slope after fitting
-			//cout<<fitstart<<" "<<xmax<<" "<<fit_goodness<<endl;
-			if((fit_goodness<400. || fit_goodness < (0.5 * fg0)) && slope > 10. && slope < 50.)
+			vector<CalibFit> fits(min(block,n_cell-first));
+			for(size_t k=0;k<fits.size();k++)
 			{
-				fit_goodvalue_found = true;
-				fitend = xmax;
-				break;
+				pool.Submit([this,&fits,&worker_f1,&mode,first,k]{
+					fits[k] = FitCell(first+k,mode,worker_f1[ThreadPool::WorkerIndex()].get());
+				});
 			}
-		}
-		if(fit_goodvalue_found)
-		{
-			cout<<"fit good value found: "<<cellid<<" "<<fitstart<<" "<<fitend<<" "<<fit_goodness<<" "<<fg0<<endl;
-		}
-		else
-		{
-			i.second->Fit("f1","q","",fitstart,fitend);
-			fit_goodness = f1->GetChisquare()/f1->GetNDF();
-		}
-		// Find the maximum to be the platform
-		bool found_max=false; 
-		for(int jbin=i.second->GetNbinsY();jbin>0;jbin--)
-		{
-			for(int ibin=0;ibin<i.second->GetNbinsX();ibin++)
+			pool.Wait();
+			for(size_t k=0;k<fits.size();k++)
 			{
-				// if(i.second->GetBinContent(ibin,jbin)>0.1)
-				// {
-					// found_max=true;
-					// i.second->Fit("f2","q+","",i.second->GetXaxis()->GetBinCenter(ibin)-10,i.second->GetXaxis()->GetBinCenter(ibin)+10);
-					// highgain_platform = f2->GetParameter(0);
-				// }
-				// if(found_max)break;
-			}
-			// if(found_max)break;
-		}
-		slope = f1->GetParameter(0); // Slope after fitting
-		//
-		//2D for each layer following
-		map_layer_dacslope[layer]->Fill(chip,channel,slope);
-		map_layer_fit[layer]->Fill(chip,channel,fit_goodness);
-		map_layer_highgainplatform[layer]->Fill(chip,channel,highgain_platform); // High gain Platform map
+				CalibFit &fit = fits[k];
+				if(!fit.line_agrees)n_disagree++;
+				int layer = fit.id.Layer();
+				int channel = fit.id.Channel();
+				int chip = fit.id.Chip();
+				if(fit.message!="")cout<<fit.message<<endl;
+				//2D for each layer following
+				map_layer_dacslope[layer]->Fill(chip,channel,fit.slope);
+				map_layer_fit[layer]->Fill(chip,channel,fit.fit_goodness);
+				map_layer_highgainplatform[layer]->Fill(chip,channel,fit.highgain_platform); // High gain Platform map
 
-		// 2D for all layers following
-		hdacslope->Fill(layer*9+chip,channel,slope);
-		hfit->Fill(layer*9+chip,channel,fit_goodness);
-		hhighgain_platform->Fill(layer*9+chip,channel,highgain_platform);
+				// 2D for all layers following
+				hdacslope->Fill(layer*chips+chip,channel,fit.slope);
+				hfit->Fill(layer*chips+chip,channel,fit.fit_goodness);
+				hhighgain_platform->Fill(layer*chips+chip,channel,fit.highgain_platform);
 
-		//Save histograms
-		TString dir_name = TString("calib/layer_") + TString(to_string(layer).c_str());
-		fout->cd(dir_name);
-		i.second->Write();
+				//Save histograms
+				TString dir_name = TString("calib/layer_") + TString(to_string(layer).c_str());
+				fout->cd(dir_name);
+				fit.hist->Write();
 
-		//Fill tree
-		_cellid = cellid;
-		_slope = slope;
-		tout->Fill();
-	});
+				//Fill tree
+				_cellid = fit.id.Decimal();
+				_slope = fit.slope;
+				tout->Fill();
+				cell_calib[first+k].reset();
+			}
+		}
+		cout<<n_disagree<<" cells where the fit and the closed-form line of its range disagree by more than "<<100*line_tolerance<<"%"<<endl;
+	}
 	fout->cd();
 	tout->Write();
 	cout<<"Out Tree Saved"<<endl;
-	for(int i=0;i<40;i++)
+	for(int i:geometry.ActiveLayers())
 	{
 		TString dir_name = TString("calib/layer_") + TString(to_string(i).c_str());
 		fout->cd(dir_name);
@@ -239,7 +199,279 @@ int DacManager::AnaDac(const std::string &list,const TString &mode)
 	hfit->Write();
 	hhighgain_platform->Write();
 	fout->Close();
-	return 0;
+	return 1;
+}
+
+// Fit range scan and fit of one cell, touches nothing but its own result and the worker's f
+CalibFit DacManager::FitCell(const int index,const TString &mode,TF1 *f) const
+{
+	CalibFit fit;
+	fit.id = geometry.FromIndex(index);
+	const int cellid = fit.id.Decimal();
+	const SparseHist2D &sparse = cell_calib[index] ? *cell_calib[index] : calib_empty;
+	TString calib_name="hdac_"+TString(to_string(cellid).c_str());
+	fit.hist.reset(sparse.MakeTH2(calib_name));
+	double fit_goodness = 10000.; // Initialize a large fit value
+	bool fit_goodvalue_found=false;
+	double fitstart=100.,fitend=3000.;
+	double slope = -10.; // Slope after fitting
+	if(mode == "dac")
+	{
+		fitstart = 0.;
+		fitend = 3000.;
+	}
+	// With range_scan the upper limit is scanned in 50 ADC steps with closed-form line fits of HG on LG
+	// from prefix sums over the columns, so the slope is HG/LG as the window expects. Their goodness is
+	// the variance of the HG residuals: 400 ADC^2 is a 20 ADC spread around the line. Only the chosen
+	// range is fitted with f. Without it f is fitted over the whole range, as the output always was.
+	PrefixLineFit lines(sparse);
+	double fg0 = lines.Fit(fitstart,fitend).Chi2NDF(); //Fit goodness at largest range
+	LineFit line;
+	for(int xmax=fitend;range_scan && xmax>=0;xmax-=50)
+	{
+		line = lines.Fit(fitstart,xmax);
+		fit_goodness = line.Chi2NDF();
+		slope = line.slope; // Slope after fitting
+		if((fit_goodness<400. || fit_goodness < (0.5 * fg0)) && slope > 10. && slope < 50.)
+		{
+			fit_goodvalue_found = true;
+			fitend = xmax;
+			break;
+		}
+	}
+	if(fit_goodvalue_found)
+	{
+		ostringstream message;
+		message<<"fit good value found: "<<cellid<<" "<<fitstart<<" "<<fitend<<" "<<fit_goodness<<" "<<fg0;
+		fit.message = message.str();
+	}
+	fit.hist->Fit(f,"q","",fitstart,fitend);
+	fit.fit_goodness = f->GetChisquare()/f->GetNDF();
+	fit.slope = f->GetParameter(0); // Slope after fitting
+	// Confirmation of the scan: the closed-form line of the chosen range against the fit of f. f is
+	// LG = p0*HG + p1 on the TH2D (x is HG), the line HG = slope*LG + intercept, so the line is compared
+	// with HG = LG/p0 - p1/p0
+	if(!fit_goodvalue_found)line = lines.Fit(fitstart,fitend);
+	fit.line_slope = line.slope;
+	fit.line_intercept = line.intercept;
+	const double p0 = f->GetParameter(0),p1 = f->GetParameter(1);
+	const double fit_hg_slope = p0!=0. ? 1./p0 : 0.;
+	const double fit_hg_intercept = p0!=0. ? -p1/p0 : 0.;
+	fit.line_agrees = line.ndf<=0 ||
+		(fabs(fit_hg_slope-line.slope)<=line_tolerance*fabs(line.slope) && fabs(fit_hg_intercept-line.intercept)<=line_tolerance*(fitend-fitstart));
+	if(!fit.line_agrees)
+	{
+		ostringstream message;
+		message<<"fit and line disagree: "<<cellid<<" HG/LG "<<fit_hg_slope<<" vs "<<line.slope<<", HG at LG 0 "<<fit_hg_intercept<<" vs "<<line.intercept;
+		fit.message += (fit.message=="" ? "" : "\n")+message.str();
+	}
+	fit.highgain_platform = FindPlateau(sparse);
+	return fit;
+}
+
+// High gain saturation from the HG profile along LG: mean HG of every LG row with at least
+// min_entries. The profile rises with LG until HG saturates; the plateau is the top rows that
+// stay within tolerance of the profile maximum, at least min_rows of them and none falling back
+// below it. Returns their weighted mean HG, 10000 if the profile is still rising at the top.
+double DacManager::FindPlateau(const SparseHist2D &sparse)
+{
+	const double min_entries = 5.;
+	const int min_rows = 3;
+	const int ny = sparse.BinsY();
+	vector<double> w(ny+2,0.),wx(ny+2,0.);
+	sparse.ForEachBin([&](const int binx,const int biny,const uint32_t count){
+		if(binx<1 || binx>sparse.BinsX() || biny<1 || biny>ny)return;
+		w[biny] += count;
+		wx[biny] += count*sparse.CenterX(binx);
+	});
+	double hg_max = -1.;
+	for(int j=1;j<=ny;j++)
+		if(w[j]>=min_entries)hg_max = max(hg_max,wx[j]/w[j]);
+	if(hg_max<0.)return 10000.;
+	// Two HG bins or 1% of the plateau, whichever is wider
+	const double tolerance = max(2.*(sparse.CenterX(2)-sparse.CenterX(1)),0.01*hg_max);
+	int rows = 0;
+	double plateau_w = 0.,plateau_wx = 0.;
+	for(int j=ny;j>=1;j--)
+	{
+		if(w[j]<min_entries)continue;
+		if(wx[j]/w[j]<hg_max-tolerance)break;
+		rows++;
+		plateau_w += w[j];
+		plateau_wx += wx[j];
+	}
+	return rows>=min_rows ? plateau_wx/plateau_w : 10000.;
+}
+
+void DacManager::FillCalib(const int index,const double highgain,const double lowgain)
+{
+	unique_ptr<SparseHist2D> &calib = cell_calib[index];
+	if(!calib)
+	{
+		calib.reset(new SparseHist2D(calib_empty));
+		vec_cellid.push_back(geometry.FromIndex(index).Decimal());
+	}
+	calib->Fill(highgain,lowgain);
+}
+
+// Files are read on a pool, every worker fills its own sparse histograms, merged in worker order.
+// 0 if a file could not be read.
+int DacManager::FillFiles(const TString &mode)
+{
+	ROOT::EnableThreadSafety();
+	ThreadPool pool(nthreads);
+	cout<<"Calibration threads: "<<pool.Size()<<endl;
+	StartWorkers(pool.Size());
+	atomic<bool> failed(false);
+	for(auto tmp:list)
+	{
+		cout<<tmp<<endl;
+		const int sel_channel = mode=="dac" ? DacChannel(tmp) : -1;
+		pool.Submit([this,tmp,sel_channel,&failed]{
+			RawHitReader reader;
+			if(!reader.Open(tmp))
+			{
+				cout<<"Calibration fill failed: cant read Raw_Hit of "<<tmp<<endl;
+				failed = true;
+				return;
+			}
+			vector< unique_ptr<SparseHist2D> > &calib = worker_calib[ThreadPool::WorkerIndex()];
+			reader.ForEachEntry([&](Long64_t){
+				const vector<int> &hitTag = reader.HitTag();
+				const vector<int> &cellID = reader.CellID();
+				const vector<double> &HG_Charge = reader.HG_Charge();
+				const vector<double> &LG_Charge = reader.LG_Charge();
+				for(size_t i=0;i<hitTag.size();i++)
+				{
+					const int index = SelectHit(hitTag[i],cellID[i],sel_channel);
+					if(index<0)continue;
+					unique_ptr<SparseHist2D> &cell = calib[index];
+					if(!cell)cell.reset(new SparseHist2D(calib_empty));
+					cell->Fill(HG_Charge[i],LG_Charge[i]);
+				}
+			},5); // Skip the first 5 events from Hao Liu
+		});
+	}
+	pool.Wait();
+	MergeWorkers();
+	return failed ? 0 : 1;
+}
+
+// Hit selection of every engine, the cell index or -1
+int DacManager::SelectHit(const int hittag,const int cellid,const int sel_channel) const
+{
+	if(b_dac && hittag!=1)return -1; // For DAC we set =1 , for cosmic rays we skip 0
+	if(b_cosmic && hittag==0)return -1;
+	const CellID id = CellID::FromDecimal(cellid);
+	if(b_dac && id.Channel()!=sel_channel)return -1; // if channel number != dac channel, skip it!
+	return geometry.Index(id); // memory cell 0 of the geometry only
+}
+
+void DacManager::StartWorkers(const int workers)
+{
+	worker_calib.clear();
+	worker_calib.resize(workers);
+	for(auto &calib:worker_calib)calib.resize(geometry.Cells());
+}
+
+void DacManager::MergeWorkers()
+{
+	for(auto &calib:worker_calib)
+	{
+		for(int index=0;index<geometry.Cells();index++)
+		{
+			if(!calib[index])continue;
+			unique_ptr<SparseHist2D> &merged = cell_calib[index];
+			if(!merged)
+			{
+				merged = move(calib[index]);
+				vec_cellid.push_back(geometry.FromIndex(index).Decimal());
+			}
+			else merged->Add(*calib[index]);
+		}
+		calib.clear();
+	}
+	worker_calib.clear();
+}
+
+// Decoded events of the fused pipeline, with the FillFiles selection on the calling decoder's worker
+void DacManager::StartDecoded(const TString &mode,const int workers)
+{
+	Book(mode);
+	StartWorkers(workers);
+}
+
+EventSink DacManager::DecodedSink(const string &dat_file,const int worker)
+{
+	const int sel_channel = b_dac ? DacChannel(dat_file) : -1;
+	return [this,sel_channel,worker](const EventChunk &chunk,const size_t hit_begin,const size_t hit_end,const int event_no,const unsigned int){
+		if(event_no<5)return; // Skip the first 5 events from Hao Liu
+		vector< unique_ptr<SparseHist2D> > &calib = worker_calib[worker];
+		for(size_t i=hit_begin;i<hit_end;i++)
+		{
+			const int index = SelectHit(chunk.hitTag[i],chunk.cellID[i],sel_channel);
+			if(index<0)continue;
+			unique_ptr<SparseHist2D> &cell = calib[index];
+			if(!cell)cell.reset(new SparseHist2D(calib_empty));
+			cell->Fill(chunk.HG_Charge[i],chunk.LG_Charge[i]);
+		}
+	};
+}
+
+int DacManager::FinishDecoded()
+{
+	MergeWorkers();
+	cout<<"Fill histogram done"<<endl;
+	return WriteCalib();
+}
+
+// Same selection as FillFiles, on RDataFrame. The per-cell TH2Ds are shared, so every slot
+// keeps the selected hits and fills them in blocks under a lock. 0 if the event loop failed.
+int DacManager::FillRDF(const TString &mode)
+{
+	vector<int> file_channel(list.size(),-1);
+	if(mode=="dac")
+		for(size_t i=0;i<list.size();i++)file_channel[i] = DacChannel(list[i]);
+	RawHitFrame frame(list,nthreads,5); // Skip the first 5 events of every file from Hao Liu
+	struct Hit
+	{
+		int index;
+		double highgain;
+		double lowgain;
+	};
+	vector<vector<Hit>> slot_hits(frame.Slots());
+	mutex fill_mutex;
+	auto flush = [this,&fill_mutex](vector<Hit> &hits){
+		lock_guard<mutex> lock(fill_mutex);
+		for(auto &hit:hits)FillCalib(hit.index,hit.highgain,hit.lowgain);
+		hits.clear();
+	};
+	try
+	{
+		frame.Node()
+			.Define("index",[this,&file_channel](const RVec<int> &cellID,const RVec<int> &hitTag,int file_index){
+				const int sel_channel = file_channel[file_index];
+				RVec<int> index(cellID.size(),-1);
+				for(size_t i=0;i<cellID.size();i++)index[i] = SelectHit(hitTag[i],cellID[i],sel_channel);
+				return index;
+			},{"CellID","hittag","file_index"})
+			.Define("selected","index>=0")
+			.ForeachSlot([&slot_hits,&flush](unsigned int slot,const RVec<int> &index,const RVec<double> &HG_Charge,const RVec<double> &LG_Charge,const RVec<int> &selected){
+				const RVec<int> cells = index[selected];
+				const RVec<double> highgain = HG_Charge[selected];
+				const RVec<double> lowgain = LG_Charge[selected];
+				vector<Hit> &hits = slot_hits[slot];
+				for(size_t i=0;i<cells.size();i++)hits.push_back({cells[i],highgain[i],lowgain[i]});
+				if(hits.size()>=65536)flush(hits);
+			},{"index","hg","lg","selected"});
+	}
+	catch(exception &e)
+	{
+		cout<<"Calibration fill failed: "<<e.what()<<endl;
+		return 0;
+	}
+	for(auto &hits:slot_hits)flush(hits);
+	return 1;
 }
 
 // void DacManager::ReadTree(TString fname)
@@ -0,0 +1,87 @@
+#include "DatGenerator.h"
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+DatGenerator::DatGenerator(const GeneratorSettings &settings) : s(settings),rng(settings.seed),event_no(0),cycleID(0x10000),triggerID(0)
+{
+}
+
+void DatGenerator::Word(vector<unsigned char> &out,const int word)
+{
+	out.push_back((word>>8)&0xff);
+	out.push_back(word&0xff);
+}
+
+void DatGenerator::Chip(vector<unsigned char> &out,const int chip)
+{
+	// Values stay below 0x4000, so chip data never looks like a frame marker
+	uniform_real_distribution<double> flat(0.,1.);
+	uniform_int_distribution<int> pedestal(300,500);
+	uniform_int_distribution<int> signal(500,4095);
+	for(int m=0;m<s.memory_depth;m++)
+	{
+		int adc[36];
+		bool gain[36];
+		for(int ch=0;ch<36;ch++)
+		{
+			const bool hit = flat(rng)<s.occupancy;
+			adc[ch] = hit ? signal(rng) : pedestal(rng);
+			gain[ch] = s.auto_gain && adc[ch]<2000;
+			int tdc = s.auto_gain ? pedestal(rng) : adc[ch]+pedestal(rng)%64;
+			Word(out,(hit?0x1000:0) | (gain[ch]?0x2000:0) | (tdc&0x0fff));
+		}
+		for(int ch=0;ch<36;ch++) Word(out,(gain[ch]?0x2000:0) | adc[ch]);
+	}
+	for(int m=0;m<s.memory_depth;m++) Word(out,(event_no*7+m)&0x0fff);
+	Word(out,chip+1);
+}
+
+void DatGenerator::Event(vector<unsigned char> &out)
+{
+	const unsigned char event_begin[4]={0xfb,0xee,0xfb,0xee};
+	const unsigned char event_end[4]={0xfe,0xdd,0xfe,0xdd};
+	const unsigned char spiroc_begin[4]={0xfa,0x5a,0xfa,0x5a};
+	const unsigned char spiroc_end[4]={0xfe,0xee,0xfe,0xee};
+	out.insert(out.end(),event_begin,event_begin+4);
+	for(int layer=0;layer<s.layers;layer++)
+	{
+		out.insert(out.end(),spiroc_begin,spiroc_begin+4);
+		Word(out,cycleID>>16);
+		Word(out,cycleID);
+		Word(out,triggerID);
+		for(int chip=0;chip<s.chips;chip++) Chip(out,chip);
+		out.insert(out.end(),spiroc_end,spiroc_end+4);
+		out.push_back(0xff);
+		out.push_back(layer);
+	}
+	unsigned int counter = (event_no*100+5)&0x3fffffff;
+	if(s.cherenkov) counter |= (rng()&3u)<<30;
+	for(int i=3;i>=0;i--) out.push_back((counter>>(8*i))&0xff);
+	out.insert(out.end(),event_end,event_end+4);
+	event_no++;
+	triggerID = (triggerID+1)&0xffff;
+	if(event_no%1000==0) cycleID++;
+}
+
+int DatGenerator::Write(const string &fname)
+{
+	ofstream f_out(fname,ios::out|ios::binary);
+	if(!f_out)
+	{
+		cout<<"cant create "<<fname<<endl;
+		return 0;
+	}
+	vector<unsigned char> buffer;
+	for(int i=0;i<s.events;i++)
+	{
+		Event(buffer);
+		if(buffer.size()>(16UL<<20) || i==s.events-1)
+		{
+			f_out.write((const char*)buffer.data(),buffer.size());
+			buffer.clear();
+		}
+	}
+	return f_out.good() ? 1 : 0;
+}
@@ -1,22 +1,32 @@
 #include "DatManager.h"
 #include "Global.h"
+#include <chrono>
+#include <iomanip>
+#include <deque>
+#include <future>
+#include <exception>
+#include "ThreadPool.h"
+#include "ChannelUnpack.h"
 using namespace std;
 extern char char_tmp[200];
-int int_tmp=0;
+thread_local int int_tmp=0;
 int flag=0;
-int DatManager::CatchEventBag(ifstream &f_in, vector<int> &buffer_v, long &cherenkov_counter){
+int DatManager::CatchEventBag(ifstream &f_in, vector<unsigned char> &buffer_v, long &cherenkov_counter){
 	//cout<<"catch a bag"<<endl;
 	bool b_begin=0;
 	bool b_end=0;
 	int buffer=0;
+	// The begin marker is searched with a rolling 4-byte window instead of erasing the buffer front
+	uint32_t window=0;
+	int n_read=0;
 	buffer_v.clear();
 	while(!b_begin && f_in.read((char*)(&buffer),1) ){
 		//cout<<hex<<buffer<<" ";
-		buffer_v.push_back(buffer);
-		// cout<<hex<<buffer<<" "<<endl;
-		if(buffer_v.size()>4) buffer_v.erase(buffer_v.begin(),buffer_v.begin()+buffer_v.size()-4);
-		if(buffer_v.size()==4 && buffer_v[0]==0xfb && buffer_v[1]==0xee && buffer_v[2]==0xfb && buffer_v[3]==0xee) b_begin=1;
+		window = window<<8 | (buffer&0xff);
+		n_read++;
+		if(n_read>=4 && window==0xfbeefbee) b_begin=1;
 	}
+	if(b_begin) buffer_v.assign({0xfb,0xee,0xfb,0xee});
 	while(!b_end && f_in.read((char*)(&buffer),1)){
 		buffer_v.push_back(buffer);
 		int_tmp = buffer_v.size();
@@ -47,237 +57,310 @@ int DatManager::CatchEventBag(ifstream &f_in, vector<int> &buffer_v, long &chere
 	if(f_in.eof())return 0;
 	else return 1;
 }
-int DatManager::CatchSPIROCBag(ifstream &f_in, vector<int> &buffer_v, int &layer_id,int &cycleID,int &triggerID){
-	//cout<<"catch a bag"<<endl;
-	bool b_begin=0;
-	bool b_end=0;
-	int buffer=0;
-	while(!b_begin && f_in.read((char*)(&buffer),1) ){
-		//cout<<hex<<buffer<<" ";
-		buffer_v.push_back(buffer);
-		if(buffer_v.size()>4) buffer_v.erase(buffer_v.begin(),buffer_v.begin()+buffer_v.size()-4);
-		if(buffer_v[0]==0xfa && buffer_v[1]==0x5a && buffer_v[2]==0xfa && buffer_v[3]==0x5a && buffer_v.size()==4) b_begin=1;
-	}
-	while(!b_end && f_in.read((char*)(&buffer),1)){
-		buffer_v.push_back(buffer);
-		int_tmp = buffer_v.size();
-		//if(int_tmp>4 && buffer_v[int_tmp-2] == 0xfe && buffer_v[int_tmp-1] == 0xee && buffer_v[int_tmp-4] == 0xfe && buffer_v[int_tmp-3] == 0xee) b_end=1;
-		if(int_tmp>=4 && buffer_v[int_tmp-2] == 0xfe && buffer_v[int_tmp-1] == 0xee && buffer_v[int_tmp-4] == 0xfe && buffer_v[int_tmp-3] == 0xee) b_end=1;
-	}
-	f_in.read((char*)(&buffer),1); 
-	if(buffer!=0xff){
-		cout<<" abnormal layer ff "<<hex<<buffer<<endl;
-		buffer_v.clear();
+int DatManager::CatchEventBag(const MappedFile &f_in, size_t &pos, const unsigned char* &bag, size_t &bag_size, long &cherenkov_counter){
+	// Same bag boundaries as the stream version, but the bag is a view into the mapped file
+	const unsigned char *data = f_in.Data();
+	const size_t size = f_in.Size();
+	size_t i_begin = pos+FindMarker(data+pos,size-pos,kEventBegin);
+	bag = data+pos;
+	bag_size = 0;
+	if(i_begin+4>size){
+		pos = size;
+		cout<<"CatchEventBag:abnormal end "<<endl;
 		return 0;
 	}
-	f_in.read((char*)(&buffer),1); 
-	if(buffer<0 || buffer>39){
-		cout<<" abnormal layer "<<hex<<buffer<<endl;
-		buffer_v.clear();
+	size_t i_end = i_begin+4+FindMarker(data+i_begin+4,size-i_begin-4,kEventEnd);
+	bag = data+i_begin;
+	if(i_end+4>size){
+		bag_size = size-i_begin;
+		pos = size;
+		cout<<"CatchEventBag:abnormal end "<<endl;
 		return 0;
 	}
-	layer_id=buffer;        
-	//cout<<"cycleID "<<hex<<cycleID<<endl;
-	if( (buffer_v.size())%2 ){
-		cout<<"wrong bag size "<<dec<<buffer_v.size()<<endl;
-		buffer_v.clear();
-		return 0;//b_readover
-	}
-	for (int i = 0; i < buffer_v.size()/2; ++i){
-		buffer_v[i] = buffer_v[2*i]*0x100+buffer_v[2*i+1];
-	}
-	buffer_v.erase(buffer_v.begin()+buffer_v.size()/2,buffer_v.end());
-	cycleID = buffer_v[2]*0x10000+buffer_v[3];
-	triggerID = buffer_v[4];
-	buffer_v.erase(buffer_v.begin()+2,buffer_v.begin()+5);
-	if(f_in.eof())return 0;
-	else return 1;
+	pos = i_end+4;
+	bag_size = pos-i_begin;
+	cherenkov_counter = (long)bag[bag_size-8]<<24 | (long)bag[bag_size-7]<<16 | (long)bag[bag_size-6]<<8 | (long)bag[bag_size-5];
+	return 1;
 }
-int DatManager::CatchSPIROCBag(vector<int> &EventBuffer_v, vector<int> &buffer_v, int &layer_id,int &cycleID,int &triggerID){
-	//cout<<"catch a bag"<<endl;
-	if(EventBuffer_v.size()<74){
-		EventBuffer_v.clear();
+int DatManager::CatchSPIROCBag(const unsigned char *EventBuffer, const size_t size, size_t &pos, SpirocBag &spiroc, int &layer_id,int &cycleID,int &triggerID){
+	// EventBuffer[pos,size) is the part of the event bag not consumed yet
+	if(size-pos<74){
+		pos=size;
 		return 0;
 	}
-	buffer_v.clear();
-	bool b_begin=0;
-	bool b_end=0;
-	int buffer=0;
-	int i_begin=0;
-	int i_end=0;
-	// cout <<hex<<EventBuffer_v[0]<<" "<<EventBuffer_v[1]<<" "<<EventBuffer_v[2]<<" "<<EventBuffer_v[3]<<" "<<EventBuffer_v.size()<<endl;
-	for (int i = 0; i < EventBuffer_v.size(); ++i){
-		if(b_begin==0 && EventBuffer_v[i]==0xfa && EventBuffer_v[i+1]==0x5a && 
-				EventBuffer_v[i+2]==0xfa && EventBuffer_v[i+3]==0x5a && i < EventBuffer_v.size()-4){
-			b_begin=1;
-			i_begin=i;
-			// cout<<hex<<i_begin<<" "<<EventBuffer_v[i]<<" "<<EventBuffer_v[i+1]<<" "<<EventBuffer_v[i+2]<<" "<<EventBuffer_v[i+3]<<" "<<EventBuffer_v.size()<<endl;
-		}
-		if(b_begin==1 && i > 2 && EventBuffer_v[i-3]==0xfe && EventBuffer_v[i-2]==0xee && 
-				EventBuffer_v[i-1]==0xfe && EventBuffer_v[i]==0xee){
-			b_end=1;
-			i_end=i;
-			break;
-		}            
-	}    
-	// cout<<hex<<i_begin<<" "<<i_end<<" "<<EventBuffer_v.size()<<" "<<b_begin<<" "<<b_end<<endl;
-	if((b_begin*b_end)==0){buffer_v.clear();EventBuffer_v.clear();return 0;}
-	buffer_v.assign(EventBuffer_v.begin()+i_begin,EventBuffer_v.begin()+i_end+1);
-	EventBuffer_v.erase(EventBuffer_v.begin(),EventBuffer_v.begin()+i_end+1);
+	spiroc.Clear();
+	// SPIROC markers come from the ScanMarkers pass over the event bag
+	while(_i_marker<_markers.size() && _markers[_i_marker].offset<pos) _i_marker++;
+	size_t i_marker=_i_marker;
+	while(i_marker<_markers.size() && _markers[i_marker].type!=kSPIROCBegin) i_marker++;
+	if(i_marker==_markers.size() || _markers[i_marker].offset+4>=size){pos=size;return 0;}
+	const size_t i_begin=_markers[i_marker].offset-pos;
+	while(i_marker<_markers.size() && (_markers[i_marker].type!=kSPIROCEnd || _markers[i_marker].offset<pos+i_begin+4)) i_marker++;
+	if(i_marker==_markers.size()){pos=size;return 0;}
+	const size_t i_end=_markers[i_marker].offset+3-pos;
+	const unsigned char *E = EventBuffer+pos;
+	pos+=i_end+1;
 	//Read in buffer over
-	if(EventBuffer_v.size()<2){EventBuffer_v.clear();buffer_v.clear();cout<<" abnormal Eventbuffer "<<endl;return 0;}
-	if(EventBuffer_v[0]!=0xff){
-		cout<<" abnormal layer ff "<<hex<<EventBuffer_v[0]<<endl;
-		buffer_v.clear();
-		return 0;
-	}   
-	if(EventBuffer_v[1]<0 || EventBuffer_v[1]>39){
-		cout<<" abnormal layer "<<hex<<EventBuffer_v[1]<<endl;
-		buffer_v.clear();
+	if(size-pos<2){pos=size;cout<<" abnormal Eventbuffer "<<endl;return 0;}
+	if(EventBuffer[pos]!=0xff){
+		cout<<" abnormal layer ff "<<hex<<(int)EventBuffer[pos]<<endl;
 		return 0;
 	}
-	layer_id=EventBuffer_v[1];
-	EventBuffer_v.erase(EventBuffer_v.begin(),EventBuffer_v.begin()+2);        
-	//cout<<"cycleID "<<hex<<cycleID<<endl;
-	if( (buffer_v.size())%2 ){
-		cout<<"wrong bag size "<<dec<<buffer_v.size()<<endl;
-		buffer_v.clear();
+	if(!geometry.Active(EventBuffer[pos+1])){
+		cout<<" abnormal layer "<<hex<<(int)EventBuffer[pos+1]<<endl;
 		return 0;
 	}
-	for (int i = 0; i < buffer_v.size()/2; ++i){
-		buffer_v[i] = buffer_v[2*i]*0x100+buffer_v[2*i+1];
+	layer_id=EventBuffer[pos+1];
+	pos+=2;
+	const size_t bag_size=i_end+1-i_begin;
+	if( bag_size%2 || bag_size<10 ){
+		cout<<"wrong bag size "<<dec<<bag_size<<endl;
+		return 0;
 	}
-	buffer_v.erase(buffer_v.begin()+buffer_v.size()/2,buffer_v.end());
-	cycleID = buffer_v[2]*0x10000+buffer_v[3];
-	triggerID = buffer_v[4];
-	buffer_v.erase(buffer_v.begin()+2,buffer_v.begin()+5);
+	// The bag stays in the event buffer, words are merged when they are read
+	const unsigned char *B = E+i_begin;
+	cycleID = (B[4]*0x100+B[5])*0x10000+B[6]*0x100+B[7];
+	triggerID = B[8]*0x100+B[9];
+	spiroc.bytes = B;
+	spiroc.n_words = bag_size/2;
 	return 1;
 }
-int DatManager::DecodeAEvent(vector<int> &chip_v,int layer_id,int Memo_ID,const bool b_auto_gain){
-	int size=chip_v.size();
-	if((size%73)!=1){
-		cout<<"wrong chip size "<<chip_v.size()<<endl;
-		return 0;
-	}
-	int Memo_No=size/channel_FEE;
-	int offset=72*(Memo_No-1);    
-	for(int i_ch=0; i_ch<channel_No; ++i_ch){//72+BCID+Chip
-		int chanID = channel_No-1-i_ch;
-		int gain = chip_v.at(i_ch+offset+channel_No)&0x2000;
-		int hit  = chip_v.at(i_ch+offset)&0x1000;
-		int tdc  = chip_v.at(i_ch+offset)&0x0fff;
-		int gainTag_tdc  = chip_v.at(i_ch+offset)&0x2000;
-		int adc  = chip_v.at(i_ch+offset+channel_No)&0x0fff;
-		int chip = chip_v[size-1]-1;
-		int BCID = chip_v[size-2];           
-		// if(hit<=1)continue;
-		_cellID.push_back(layer_id*1E5+chip*pow(10,4)+Memo_ID*pow(10,2)+chanID);
-		_bcid.push_back(BCID);
-		if(hit>1)_hitTag.push_back(1);
-		else _hitTag.push_back(0);
-
-		if(b_auto_gain){
-			if(gain){
-				_gainTag.push_back(1);
-				_HG_Charge.push_back(adc);
-				_LG_Charge.push_back(-1);
-			}
-			else{
-				_gainTag.push_back(0);
-				_HG_Charge.push_back(-1);
-				_LG_Charge.push_back(adc);
-			}
-			_Hit_Time.push_back(tdc);
-			if(gainTag_tdc)
-				_gainTag_tdc.push_back(1);
-			else 
-				_gainTag_tdc.push_back(0);
-
-		}
-		else{
-			_HG_Charge.push_back(tdc);
-			_LG_Charge.push_back(adc);
-			_Hit_Time.push_back(-1);
-			_gainTag.push_back(-1);
-			if(gainTag_tdc)
-				_gainTag_tdc.push_back(1);
-			else 
-				_gainTag_tdc.push_back(0);
-		}
-	}
-	/*for (int i = 0; i < chip_v.size(); ++i){
-	  cout<<hex<<chip_v[i]<<" ";
-	  }
-	  cout<<endl;
-	  */
-	chip_v.erase(chip_v.end()-2,chip_v.end()-1);
-	chip_v.erase(chip_v.begin()+offset,chip_v.begin()+offset+72);
-	if(chip_v.size()==1)chip_v.clear();
+int DatManager::DecodeAEvent(int layer_id,int chip,int Memo_ID,const bool b_auto_gain,EventChunk &chunk){
+	// The last memory cell of the chip is decoded
+	const int i_cell=_builder.Cells(layer_id,chip)-1;
+	const int BCID=_builder.BCID(layer_id,chip,i_cell);
+	// The columns grow by one cell and UnpackCell writes the 36 channels in place
+	const size_t n=chunk.cellID.size();
+	chunk.cellID.resize(n+channel_No);
+	chunk.bcid.resize(n+channel_No,BCID);
+	chunk.hitTag.resize(n+channel_No);
+	chunk.gainTag_tdc.resize(n+channel_No);
+	chunk.gainTag.resize(n+channel_No);
+	chunk.HG_Charge.resize(n+channel_No);
+	chunk.LG_Charge.resize(n+channel_No);
+	chunk.Hit_Time.resize(n+channel_No);
+	const int *cellID=CellIDRow(layer_id,chip);
+	for(int i_ch=0; i_ch<channel_No; ++i_ch) chunk.cellID[n+i_ch]=cellID[i_ch]+Memo_ID*100;
+	UnpackCell(_builder.Cell(layer_id,chip,i_cell),b_auto_gain,
+			{&chunk.hitTag[n],&chunk.gainTag_tdc[n],&chunk.gainTag[n],&chunk.HG_Charge[n],&chunk.LG_Charge[n],&chunk.Hit_Time[n]});
 	return 1;
 }
 
-int DatManager::FillChipBuffer(vector<int> &buffer_v,int cycleID,int triggerID,int layer_id){
-	int size = buffer_v.size();
+int DatManager::FillChipBuffer(SpirocBag &spiroc,int cycleID,int triggerID,int layer_id){
+	int size = spiroc.Size();
 	if(size<4){
 		//cout<<"FillChipBuffer:wrong bag size "<<size<<endl;
-		buffer_v.clear();
+		spiroc.Clear();
 		return 0;
 	}
-	if( buffer_v[0]!=0xfa5a || buffer_v[1]!=0xfa5a || buffer_v[size-2]!=0xfeee || buffer_v[size-1]!=0xfeee){
-		cout<<"FillChipBuffer:wrong bag package "<<hex<<buffer_v[0]<<" "<<buffer_v[1]<<" "<<buffer_v[size-2]<<" "<<buffer_v[size-1]<<endl;
-		buffer_v.clear();
+	if( spiroc.Word(0)!=0xfa5a || spiroc.Word(1)!=0xfa5a || spiroc.Word(size-2)!=0xfeee || spiroc.Word(size-1)!=0xfeee){
+		cout<<"FillChipBuffer:wrong bag package "<<hex<<spiroc.Word(0)<<" "<<spiroc.Word(1)<<" "<<spiroc.Word(size-2)<<" "<<spiroc.Word(size-1)<<endl;
+		spiroc.Clear();
 		return 0;
 	}
-	else{
-		buffer_v.erase(buffer_v.begin(),buffer_v.begin()+2);
-		buffer_v.erase(buffer_v.end()-2,buffer_v.end());
-		size = buffer_v.size();
-	}
-	for (int i = 0; i < buffer_v.size(); ++i){
-		//cout<<hex<<buffer_v[i]<<" ";
-	}
-	for (int i = channel_FEE; i<buffer_v.size(); i=i+channel_FEE){
-		//cout<<dec<<i<<" "<<buffer_v.size()<<" "<<hex<<buffer_v[i]<<endl;
-		if (buffer_v[i]<1 || buffer_v[i]>9) continue;
-		int chip=buffer_v[i]-1;
-		_chip_v[layer_id][chip].assign(buffer_v.begin(),buffer_v.begin()+i+1);
-		buffer_v.erase(buffer_v.begin(),buffer_v.begin()+i+1);
-		//cout<<endl<<dec<<_chip_v[layer_id][chip].back()<<" FillChipBuffer "<<" "<<buffer_v.size()<<endl;
-		i=0;
-	}
-	if(buffer_v.size()){
+	// Chip data sits between the two marker words at each end
+	size_t i_first=2;
+	const size_t i_last=size-2;
+	for (size_t i = i_first+channel_FEE; i<i_last; i=i+channel_FEE){
+		//cout<<dec<<i<<" "<<i_last-i_first<<" "<<hex<<spiroc.Word(i)<<endl;
+		int chip_word=spiroc.Word(i);
+		if (chip_word<1 || chip_word>geometry.Chips()) continue;
+		int chip=chip_word-1;
+		_builder.Fill(layer_id,chip,spiroc.WordBytes(i_first),(i-i_first)/channel_FEE);
+		i_first=i+1;
+		//cout<<endl<<dec<<chip+1<<" FillChipBuffer "<<" "<<i_last-i_first<<endl;
+		i=i_first;
+	}
+	if(i_first<i_last){
 		count_chipbuffer++;
-		cout<<hex<<cycleID<<" "<<buffer_v.back()<<" FillChipBuffer:abnormal chip buffer "<<dec<<" "<<layer_id<<" "<<buffer_v.size()<<" "<<count_chipbuffer<<endl;
-		for (int i_chip = 0; i_chip < chip_No; ++i_chip){
-			//_chip_v[layer_id][i_chip].clear();
-		}
-		buffer_v.clear();
+		cout<<hex<<cycleID<<" "<<spiroc.Word(i_last-1)<<" FillChipBuffer:abnormal chip buffer "<<dec<<" "<<layer_id<<" "<<i_last-i_first<<" "<<count_chipbuffer<<endl;
+		spiroc.Clear();
 		return 0;
 	}
+	spiroc.Clear();
 	return 1;
 }
 
-int DatManager::Decode(const string& input_file,const string& output_file,const bool b_auto_gain,const bool b_cherenkov)
+int DatManager::DecodeEventBag(const unsigned char *bag,const size_t bag_size,const long cherenkov_counter,const bool b_auto_gain,EventChunk &chunk)
 {
-	ifstream f_in;
-	int layer_id;
-	int cycleID;
-	int triggerID;
-	int BCID[Layer_No][chip_No];
-	int Memo_ID[Layer_No][chip_No];
-	f_in.open(input_file,ios::in);
-	if(!f_in){
-		cout<<"cant open "<<input_file<<endl;
-		return 0;
+	// Chip buffers are drained at the end of every bag, so a bag decodes on its own.
+	// TriggerID loop correction needs the events in file order and is left to FillChunk.
+	int layer_id=0;
+	int cycleID=0;
+	int triggerID=0;
+	int Memo_ID=0;
+	long pre_trigID=0;
+	long pre_cycleID=0;
+	size_t bag_pos=0;
+	bool b_Event=0;
+	int n_event=0;
+	_spiroc.Clear();
+	ScanMarkers(bag,bag_size,_markers);
+	_i_marker=0;
+	chunk.bags++;
+	bool b_chipbuffer=Chipbuffer_empty();//just in case
+	// cout <<dec<<chunk.bags<<" CatchEventBag size "<<bag_size<<" cherenkov_counter "<<cherenkov_counter<<endl;
+	while(bag_size-bag_pos>74){    
+		CatchSPIROCBag(bag,bag_size,bag_pos,_spiroc,layer_id,cycleID,triggerID);
+		// if(triggerID==last_trigID){
+		// 	_spiroc.Clear();
+		// 	continue;
+		// }
+		if(b_chipbuffer==0){
+			pre_trigID=triggerID;
+			pre_cycleID=cycleID;
+		}
+		if(_spiroc.Size()<74){
+			if(_spiroc.Size()!=4)cout<<"abnormal SPIROC bag size "<<_spiroc.Size()<<endl;
+			_spiroc.Clear();
+			if(!b_chipbuffer) continue;
+		}
+		if(triggerID!=pre_trigID){
+			b_Event=1;
+			cout<<pre_cycleID<<" "<<pre_trigID<<" abnormal ID "<<cycleID<<" "<<triggerID<<endl;
+			_spiroc.Clear();
+			continue;
+		}
+		else{FillChipBuffer(_spiroc,cycleID,triggerID,layer_id);}
+		FillChipBuffer(_spiroc,cycleID,triggerID,layer_id);
+		b_chipbuffer=Chipbuffer_empty();                 
+	} 
+	if(b_Event)chunk.abnormal_events++;
+	if(b_chipbuffer!=0){
+		// Only the last memory cell of every chip is decoded, so one pass empties the builder
+		for(uint64_t layer_mask=_builder.LayerMask(); layer_mask; layer_mask&=layer_mask-1){
+			int i_layer=__builtin_ctzll(layer_mask);
+			for(unsigned int chip_mask=_builder.ChipMask(i_layer); chip_mask; chip_mask&=chip_mask-1){
+				int i_chip=__builtin_ctz(chip_mask);
+				Memo_ID=_builder.Depth(i_layer,i_chip);
+				DecodeAEvent(i_layer,i_chip,Memo_ID-1,b_auto_gain,chunk);
+				if(Memo_ID!=1){
+					cout<<"abnormal Memo_ID "<<Memo_ID<<endl;
+				}
+			}
+		}
+		_builder.Clear();
+		chunk.cycleID.push_back(pre_cycleID);
+		chunk.triggerID.push_back(pre_trigID);
+		chunk.cherenkov_counter.push_back(cherenkov_counter);
+		chunk.hit_end.push_back(chunk.cellID.size());
+		n_event++;
+	}
+	return n_event;
+}
+
+void DatManager::FillChunk(const EventChunk &chunk,TTree *tree,DecodeCarry &carry,const bool b_cherenkov)
+{
+	carry.Bag_No+=chunk.bags;
+	carry.Abnormal_Event_No+=chunk.abnormal_events;
+	size_t hit_begin=0;
+	for (size_t i_event = 0; i_event < chunk.triggerID.size(); ++i_event){
+		if(carry.Event_No%1000==0)cout<<"Event_No: "<<carry.Event_No<<" Bag_No "<<carry.Bag_No<<endl;
+		long pre_trigID=chunk.triggerID[i_event];
+		long pre_cycleID=chunk.cycleID[i_event];
+		long cherenkov_counter=chunk.cherenkov_counter[i_event];
+		size_t hit_end=chunk.hit_end[i_event];
+		if((pre_trigID - carry.last_trigID) >10 && carry.last_trigID!=0){
+			cout<<hex<<pre_cycleID<<" Abnormal triggerID "<<pre_trigID<<" "<<carry.last_trigID<<endl;
+		}
+		if( carry.last_trigID - pre_trigID > 40000 ){
+			cout<<"Loop "<<pre_trigID<<" "<<carry.last_trigID<<endl;
+			carry.Loop_No++;
+		}
+		BranchClear();
+		_cycleID=pre_cycleID;
+		_triggerID=pre_trigID + carry.Loop_No*pow(2,16);
+		_Event_Time = (cherenkov_counter&0x3fffffff);
+		for(auto &sink:sinks) sink(chunk,hit_begin,hit_end,carry.Event_No,_Event_Time);
+		// Under zero suppression only hit channels are kept, except in the pedestal sample events
+		const bool b_all=!output.zero_suppression || PedestalSample(carry.Event_No);
+		_pedestal_sample=b_all;
+		if(tree && output.zero_suppression){
+			_layer_hits.assign(geometry.Layers(),0);
+			_hit_index.clear();
+			for(size_t i=hit_begin;i<hit_end;i++){
+				if(chunk.hitTag[i]!=1)continue;
+				_layer_hits[CellID::FromDecimal(chunk.cellID[i]).Layer()]++;
+				_hit_index.push_back(i);
+			}
+		}
+		auto copy_hits=[&](auto &branch,const auto &column){
+			if(b_all){
+				branch.assign(column.begin()+hit_begin,column.begin()+hit_end);
+				return;
+			}
+			branch.resize(_hit_index.size());
+			for(size_t k=0;k<_hit_index.size();k++)branch[k]=column[_hit_index[k]];
+		};
+		if(tree){
+			copy_hits(_cellID,chunk.cellID);
+			if(output.compact){
+				copy_hits(_bcid16,chunk.bcid);
+				copy_hits(_hitTag8,chunk.hitTag);
+				copy_hits(_gainTag8,chunk.gainTag);
+				copy_hits(_gainTag_tdc8,chunk.gainTag_tdc);
+				copy_hits(_HG_Charge16,chunk.HG_Charge);
+				copy_hits(_LG_Charge16,chunk.LG_Charge);
+				copy_hits(_Hit_Time16,chunk.Hit_Time);
+			}
+			else{
+				copy_hits(_bcid,chunk.bcid);
+				copy_hits(_hitTag,chunk.hitTag);
+				copy_hits(_gainTag,chunk.gainTag);
+				copy_hits(_gainTag_tdc,chunk.gainTag_tdc);
+				copy_hits(_HG_Charge,chunk.HG_Charge);
+				copy_hits(_LG_Charge,chunk.LG_Charge);
+				copy_hits(_Hit_Time,chunk.Hit_Time);
+			}
+		}
+		if(b_cherenkov){
+			_cherenkov.push_back( (cherenkov_counter&0x80000000)/0x80000000 );
+			_cherenkov.push_back( (cherenkov_counter&0x40000000)/0x40000000 );
+		}
+		else{
+			_cherenkov.push_back(-1);
+			_cherenkov.push_back(-1);
+		}
+		if(_cherenkov[0]>0) carry.Cherenkov_Event_No1++;
+		if(_cherenkov[1]>0) carry.Cherenkov_Event_No2++;
+		if(_cherenkov[0]*_cherenkov[1]>0) carry.Cherenkov_Event_No++;
+		carry.Event_No++;
+		if(tree) tree->Fill();
+		BranchClear();
+		carry.last_trigID=pre_trigID;
+		hit_begin=hit_end;
 	}
-	for (int i_layer = 0; i_layer < Layer_No; ++i_layer){
-		_buffer_v.clear();
-		for (int i_chip = 0; i_chip < chip_No; ++i_chip){
-			BCID[i_layer][i_chip]=-1;
-			Memo_ID[i_layer][i_chip]=0;
-			_chip_v[i_layer][i_chip].clear();
+}
+
+bool DatManager::PedestalSample(const int event_no) const
+{
+	// Spread evenly over the run and fixed by the event number, so it does not depend on decode-threads
+	const double f=output.pedestal_fraction;
+	if(f<=0.)return false;
+	if(f>=1.)return true;
+	return (long)((event_no+1)*f) > (long)(event_no*f);
+}
+
+int DatManager::Decode(const string& input_file,const string& output_file,const bool b_auto_gain,const bool b_cherenkov,const bool b_mmap,const int nthreads)
+{
+	ifstream f_in;
+	MappedFile f_map;
+	summary = DecodeSummary();
+	summary.file = input_file;
+	auto start_time = chrono::steady_clock::now();
+	int start_chipbuffer = count_chipbuffer;
+	if(b_mmap && !f_map.Open(input_file)){
+		cout<<"cant map "<<input_file<<", reading it as a stream"<<endl;
+	}
+	if(!f_map.IsOpen()){
+		f_in.open(input_file,ios::in|ios::binary);
+		if(!f_in){
+			cout<<"cant open "<<input_file<<endl;
+			return 0;
 		}
 	}
+	_spiroc.Clear();
+	_builder.Clear();
 	//string str_out=outputDir+"/"+"cosmic.root";
 	string tmp_string=input_file;
 	tmp_string=tmp_string.substr(tmp_string.find_last_of('/')+1);
@@ -287,138 +370,174 @@ int DatManager::Decode(const string& input_file,const string& output_file,const
 	tmp_string=tmp_string.substr(0,tmp_string.find_first_of("_"));
 	stringstream geek(tmp_string);
 	geek>>_Run_No;
-	TFile *fout;
-	fout = TFile::Open(str_out.c_str(),"RECREATE");
-	if(!fout){
-		cout<<"cant create "<<str_out<<endl;
-		return 0;
+	// Without a Raw_Hit output the events only go to the sinks
+	TFile *fout=nullptr;
+	TTree *tree=nullptr;
+	if(output.write){
+		fout = TFile::Open(str_out.c_str(),"RECREATE");
+		if(!fout){
+			cout<<"cant create "<<str_out<<endl;
+			return 0;
+		}
+		if(output.compression!=""){
+			int algorithm=-1;
+			if(output.compression=="ZLIB")algorithm=ROOT::RCompressionSetting::EAlgorithm::kZLIB;
+			else if(output.compression=="LZ4")algorithm=ROOT::RCompressionSetting::EAlgorithm::kLZ4;
+			else if(output.compression=="ZSTD")algorithm=ROOT::RCompressionSetting::EAlgorithm::kZSTD;
+			else if(output.compression=="LZMA")algorithm=ROOT::RCompressionSetting::EAlgorithm::kLZMA;
+			if(algorithm<0)cout<<"unknown compression "<<output.compression<<", keeping the ROOT default"<<endl;
+			else fout->SetCompressionSettings(ROOT::CompressionSettings((ROOT::RCompressionSetting::EAlgorithm::EValues)algorithm,output.compression_level));
+		}
+		tree = new TTree("Raw_Hit","data from binary file");
+		SetTreeBranch(tree);
+		tree->SetAutoFlush(output.autoflush);
 	}
-	TTree *tree = new TTree("Raw_Hit","data from binary file");
-	SetTreeBranch(tree);
-	int Bag_No=0;
-	int Event_No=0;
-	int Cherenkov_signal=0;
-	int Cherenkov_Event_No1=0;
-	int Cherenkov_Event_No2=0;
-	int Cherenkov_Event_No=0;
-	int Abnormal_Event_No=0;
-	int coincidence_No=0;
-	int Loop_No=0;
-	unsigned int last_Event_Time=0;
+	DecodeCarry carry;
 	long cherenkov_counter=0;
-	long pre_trigID=0;
-	long pre_cycleID=0;
-	long last_trigID=-1;
-	long last_cycleID=-1;
-	long tmp_ID=0;
-	bool b_ReadOver=1;
-	bool b_chipbuffer=0;
-	bool b_Event=0;
-	cout<<" Start Read "<<str_out<<" auto gain: "<<b_auto_gain<<" cherenkov: "<<b_cherenkov<<" Run:"<<_Run_No<<endl;
-	while(!(f_in.eof()) || b_chipbuffer){
-		//while((!(f_in.eof()) || b_chipbuffer) && Event_No<=1E4){
-		if(Event_No%1000==0)cout<<"Event_No: "<<Event_No<<" Bag_No "<<Bag_No<<endl;
-		_buffer_v.clear();
-		_EventBuffer_v.clear();
-		CatchEventBag(f_in,_EventBuffer_v,cherenkov_counter);
-		Bag_No++;
-		b_Event=0;
-		b_chipbuffer=Chipbuffer_empty();//just in case
-		// cout <<dec<<Bag_No<<" CatchEventBag size "<<_EventBuffer_v.size()<<" cherenkov_counter "<<cherenkov_counter<<endl;
-		while(_EventBuffer_v.size()>74){    
-			CatchSPIROCBag(_EventBuffer_v,_buffer_v,layer_id,cycleID,triggerID);
-			// if(triggerID==last_trigID){
-			// 	_EventBuffer_v.clear();
-			// 	_buffer_v.clear();
-			// 	continue;
-			// }
-			if(b_chipbuffer==0){
-				pre_trigID=triggerID;
-				pre_cycleID=cycleID;
-			}
-			if(_buffer_v.size()<74){
-				if(_buffer_v.size()!=4)cout<<"abnormal SPIROC bag size "<<_buffer_v.size()<<endl;
-				_buffer_v.clear();
-				if(!b_chipbuffer) continue;
+	size_t file_pos=0;
+	const unsigned char *bag=nullptr;
+	size_t bag_size=0;
+	const int decode_threads = f_map.IsOpen() ? ThreadPool::Resolve(nthreads) : 1;
+	bool b_failed=false;
+	cout<<" Start Read "<<str_out<<" auto gain: "<<b_auto_gain<<" cherenkov: "<<b_cherenkov<<" mmap: "<<f_map.IsOpen()<<" marker scan: "<<MarkerScanISA()<<" unpack: "<<ChannelUnpackISA()<<" threads: "<<decode_threads<<" Run:"<<_Run_No<<endl;
+	if(decode_threads==1){
+		EventChunk chunk;
+		while(f_map.IsOpen() ? file_pos<f_map.Size() : !(f_in.eof())){
+			//while((!(f_in.eof()) || b_chipbuffer) && Event_No<=1E4){
+			if(f_map.IsOpen()){
+				CatchEventBag(f_map,file_pos,bag,bag_size,cherenkov_counter);
 			}
-			if(triggerID!=pre_trigID){
-				b_Event=1;
-				cout<<pre_cycleID<<" "<<pre_trigID<<" abnormal ID "<<cycleID<<" "<<triggerID<<endl;
-				_buffer_v.clear();
-				continue;
-			}
-			else{FillChipBuffer(_buffer_v,cycleID,triggerID,layer_id);}
-			FillChipBuffer(_buffer_v,cycleID,triggerID,layer_id);
-			b_chipbuffer=Chipbuffer_empty();                 
-		} 
-		if(b_Event)Abnormal_Event_No++;
-		while(b_chipbuffer!=0){
-			if((pre_trigID - last_trigID) >10 && last_trigID!=0){
-				cout<<hex<<pre_cycleID<<" Abnormal triggerID "<<pre_trigID<<" "<<last_trigID<<endl;
-			}
-			if( last_trigID - pre_trigID > 40000 ){
-				cout<<"Loop "<<pre_trigID<<" "<<last_trigID<<endl;
-				Loop_No++;
+			else{
+				_EventBuffer_v.clear();
+				CatchEventBag(f_in,_EventBuffer_v,cherenkov_counter);
+				bag=_EventBuffer_v.data();
+				bag_size=_EventBuffer_v.size();
 			}
-			BranchClear();
-			for (int i_layer = 0; i_layer < Layer_No; ++i_layer){
-				for (int i_chip = 0; i_chip < chip_No; ++i_chip){
-					int size=_chip_v[i_layer][i_chip].size();
-					if(size==0)continue;
-					_cycleID=pre_cycleID;
-					_triggerID=pre_trigID + Loop_No*pow(2,16);
-					Memo_ID[i_layer][i_chip]=int(size/73);
-					DecodeAEvent(_chip_v[i_layer][i_chip],i_layer,Memo_ID[i_layer][i_chip]-1,b_auto_gain);
-					if(Memo_ID[i_layer][i_chip]!=1){                    
-						_chip_v[i_layer][i_chip].clear();
-						cout<<"abnormal Memo_ID "<<Memo_ID[i_layer][i_chip]<<endl;
-					}
+			chunk.Clear();
+			DecodeEventBag(bag,bag_size,cherenkov_counter,b_auto_gain,chunk);
+			if(f_map.IsOpen())f_map.Release(file_pos); // The bag ends at file_pos and has been parsed
+			FillChunk(chunk,tree,carry,b_cherenkov);
+		}
+	}
+	else{
+		// The main thread indexes the bag boundaries of the next chunks, the pool decodes them
+		// and the chunks are filled back in file order, so Loop_No and CycleID match the serial decoder.
+		ThreadPool pool(decode_threads);
+		vector< unique_ptr<DatManager> > decoders;
+		for (int i = 0; i < pool.Size(); ++i){
+			decoders.push_back(make_unique<DatManager>());
+			decoders.back()->SetGeometry(geometry);
+		}
+		const size_t window = 2*pool.Size();
+		vector< EventChunk > chunks(window);
+		struct ChunkInFlight{
+			size_t slot;
+			size_t end;
+			future<void> done;
+		};
+		deque< ChunkInFlight > in_flight;
+		size_t next_slot=0;
+		while(file_pos<f_map.Size() || !in_flight.empty()){
+			while(file_pos<f_map.Size() && in_flight.size()<window){
+				auto bags = make_shared< vector<EventBagRef> >();
+				const size_t chunk_begin = file_pos;
+				while(file_pos<f_map.Size() && file_pos-chunk_begin<chunk_bytes){
+					CatchEventBag(f_map,file_pos,bag,bag_size,cherenkov_counter);
+					bags->push_back({bag,bag_size,cherenkov_counter});
 				}
+				const size_t slot = next_slot++ % window;
+				auto done = make_shared< promise<void> >();
+				in_flight.push_back({slot,file_pos,done->get_future()});
+				pool.Submit([&decoders,&chunks,bags,done,slot,b_auto_gain]{
+					try{
+						DatManager &decoder = *decoders[ThreadPool::WorkerIndex()];
+						chunks[slot].Clear();
+						for(auto &ref:*bags) decoder.DecodeEventBag(ref.bag,ref.size,ref.cherenkov_counter,b_auto_gain,chunks[slot]);
+						done->set_value();
+					}
+					catch(...){
+						done->set_exception(current_exception());
+					}
+				});
 			}
-			_Event_Time = (cherenkov_counter&0x3fffffff);
-			//if(_Event_Time==last_Event_Time)cout<<"abnormal Event Time "<<_Event_Time<<" "<<last_Event_Time<<" "<<hex<<pre_trigID<<" "<<last_trigID<<endl;
-			if(b_cherenkov){
-				_cherenkov.push_back( (cherenkov_counter&0x80000000)/0x80000000 );
-				_cherenkov.push_back( (cherenkov_counter&0x40000000)/0x40000000 );
+			// A chunk that threw fails the file, once the chunks still decoding are done with the buffers
+			try{
+				in_flight.front().done.get();
 			}
-			else{
-				_cherenkov.push_back(-1);
-				_cherenkov.push_back(-1);
+			catch(exception &e){
+				cout<<"decoding "<<input_file<<" failed: "<<e.what()<<endl;
+				for(auto &c:in_flight) if(c.done.valid()) c.done.wait();
+				b_failed=true;
+				break;
 			}
-			if(_cherenkov[0]>0) Cherenkov_Event_No1++;
-			if(_cherenkov[1]>0) Cherenkov_Event_No2++;
-			if(_cherenkov[0]*_cherenkov[1]>0) Cherenkov_Event_No++;
-			Event_No++;
-			tree->Fill();
-			BranchClear();
-			b_chipbuffer=Chipbuffer_empty();
-			last_trigID=pre_trigID;
-			last_cycleID=pre_cycleID;
-			last_Event_Time=_Event_Time;
-		}                 
-	}
-	cout<<Abnormal_Event_No<<" cherenkov1 "<<Cherenkov_Event_No1<<" cherenkov2 "<<Cherenkov_Event_No2<<" cherenkov coincidence "<<Cherenkov_Event_No<<" Event No "<<Event_No<<" Bag No  "<<Bag_No<<endl;
+			FillChunk(chunks[in_flight.front().slot],tree,carry,b_cherenkov);
+			f_map.Release(in_flight.front().end);
+			in_flight.pop_front();
+		}
+		pool.Wait();
+		for(auto &decoder:decoders) count_chipbuffer+=decoder->count_chipbuffer;
+	}
+	cout<<carry.Abnormal_Event_No<<" cherenkov1 "<<carry.Cherenkov_Event_No1<<" cherenkov2 "<<carry.Cherenkov_Event_No2<<" cherenkov coincidence "<<carry.Cherenkov_Event_No<<" Event No "<<carry.Event_No<<" Bag No  "<<carry.Bag_No<<endl;
 	f_in.close();
-	tree->Write();
-	fout->Write();
-	fout->Close();
-	return 1;
+	f_map.Close();
+	if(fout){
+		if(!b_failed){
+			tree->Write();
+			fout->Write();
+		}
+		fout->Close();
+	}
+	summary.status = b_failed ? 0 : 1;
+	summary.events = carry.Event_No;
+	summary.bags = carry.Bag_No;
+	summary.abnormal_events = carry.Abnormal_Event_No;
+	summary.abnormal_chipbuffers = count_chipbuffer-start_chipbuffer;
+	summary.seconds = chrono::duration<double>(chrono::steady_clock::now()-start_time).count();
+	return summary.status;
+	}
+
+	void DatManager::PrintSummary(const vector<DecodeSummary> &summaries)
+	{
+		cout<<"DAT-ROOT summary"<<endl;
+		cout<<dec<<left<<setw(50)<<"file"<<right<<setw(8)<<"status"<<setw(12)<<"events"<<setw(12)<<"bags"<<setw(12)<<"abnormal"<<setw(12)<<"chipbuffer"<<setw(10)<<"time[s]"<<endl;
+		for(auto &s:summaries){
+			string name=s.file.substr(s.file.find_last_of('/')+1);
+			cout<<left<<setw(50)<<name<<right<<setw(8)<<(s.status?"ok":"failed")<<setw(12)<<s.events<<setw(12)<<s.bags<<setw(12)<<s.abnormal_events<<setw(12)<<s.abnormal_chipbuffers<<setw(10)<<fixed<<setprecision(1)<<s.seconds<<endl;
+		}
+		cout<<defaultfloat;
 	}
 
 	void DatManager::SetTreeBranch(TTree *tree){
+		const int basket=output.basket_size;
 		tree ->Branch("Run_Num",&_Run_No);
 		tree ->Branch("Event_Time",&_Event_Time);
 		tree ->Branch("CycleID",&_cycleID);
 		tree ->Branch("TriggerID",&_triggerID);
-		tree ->Branch("CellID",&_cellID);
-		tree ->Branch("BCID",&_bcid);
-		tree ->Branch("HitTag",&_hitTag);
-		tree ->Branch("GainTag",&_gainTag);
-		tree ->Branch("HG_Charge",&_HG_Charge);
-		tree ->Branch("LG_Charge",&_LG_Charge);
-		tree ->Branch("Hit_Time",&_Hit_Time);
-		tree ->Branch("GainTag_TDC",&_gainTag_tdc);
+		tree ->Branch("CellID",&_cellID,basket);
+		if(output.compact){
+			// Same branch names, HBase::ReadTree tells the schemas apart by the HG_Charge type
+			tree ->Branch("BCID",&_bcid16,basket);
+			tree ->Branch("HitTag",&_hitTag8,basket);
+			tree ->Branch("GainTag",&_gainTag8,basket);
+			tree ->Branch("HG_Charge",&_HG_Charge16,basket);
+			tree ->Branch("LG_Charge",&_LG_Charge16,basket);
+			tree ->Branch("Hit_Time",&_Hit_Time16,basket);
+			tree ->Branch("GainTag_TDC",&_gainTag_tdc8,basket);
+		}
+		else{
+			tree ->Branch("BCID",&_bcid,basket);
+			tree ->Branch("HitTag",&_hitTag,basket);
+			tree ->Branch("GainTag",&_gainTag,basket);
+			tree ->Branch("HG_Charge",&_HG_Charge,basket);
+			tree ->Branch("LG_Charge",&_LG_Charge,basket);
+			tree ->Branch("Hit_Time",&_Hit_Time,basket);
+			tree ->Branch("GainTag_TDC",&_gainTag_tdc,basket);
+		}
 		tree ->Branch("Cherenkov",&_cherenkov);
+		if(output.zero_suppression){
+			tree ->Branch("Layer_Hits",&_layer_hits);
+			tree ->Branch("Pedestal_Sample",&_pedestal_sample);
+		}
 	}
 
 	void DatManager::BranchClear() 
@@ -432,6 +551,14 @@ int DatManager::Decode(const string& input_file,const string& output_file,const
 		_Hit_Time.clear();
 		_gainTag_tdc.clear();
 		_cherenkov.clear();    
+		_bcid16.clear();
+		_hitTag8.clear();
+		_gainTag8.clear();
+		_HG_Charge16.clear();
+		_LG_Charge16.clear();
+		_Hit_Time16.clear();
+		_gainTag_tdc8.clear();
+		_layer_hits.clear();
 	}
 	/*int raw2Root::RMFelixTag(string inputDir,string outputDir){
 	  ifstream f_datalist,f_in[Layer_No];
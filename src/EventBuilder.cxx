@@ -0,0 +1,35 @@
+#include "EventBuilder.h"
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+EventBuilder::EventBuilder(const int _layers,const int _chips) : layers(min(_layers,max_layer)),chips(min(_chips,max_chip)),layer_mask(0)
+{
+	data.resize(layers*chips*cell_SP*cell_words*2);
+	bcid.resize(layers*chips*cell_SP*2);
+	n_cell.resize(layers*chips);
+	depth.resize(layers*chips);
+	chip_mask.assign(layers,0);
+}
+
+void EventBuilder::Fill(const int layer,const int chip,const unsigned char *words,const int _n_cell)
+{
+	const int slot = layer*chips+chip;
+	const int first = _n_cell>cell_SP ? _n_cell-cell_SP : 0;
+	const int kept = _n_cell-first;
+	// Cells and BCIDs are contiguous in the bag, so each is one copy
+	memcpy(&data[slot*cell_SP*cell_words*2],words+2*first*cell_words,2*kept*cell_words);
+	memcpy(&bcid[slot*cell_SP*2],words+2*(_n_cell*cell_words+first),2*kept);
+	n_cell[slot] = kept;
+	depth[slot] = _n_cell;
+	chip_mask[layer] |= 1u<<chip;
+	layer_mask |= 1ULL<<layer;
+}
+
+void EventBuilder::Clear()
+{
+	// Only the occupancy is reset, slot contents are overwritten by the next Fill
+	for(uint64_t m=layer_mask;m;m&=m-1) chip_mask[__builtin_ctzll(m)] = 0;
+	layer_mask = 0;
+}
@@ -0,0 +1,74 @@
+#include "Geometry.h"
+#include "RawHitReader.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+Geometry::Geometry(const int layers,const int _chips)
+{
+	vector<int> active_layers;
+	for(int layer=0;layer<layers;layer++)active_layers.push_back(layer);
+	Build(active_layers,_chips);
+}
+
+Geometry::Geometry(const vector<int> &active_layers,const int _chips)
+{
+	Build(active_layers,_chips);
+}
+
+void Geometry::Build(const vector<int> &active_layers,const int _chips)
+{
+	chips = _chips;
+	if(chips<1 || chips>CellID::n_chip)
+	{
+		cout<<"Geometry: "<<chips<<" chips out of range, using "<<CellID::n_chip<<endl;
+		chips = CellID::n_chip;
+	}
+	active.clear();
+	for(int layer:active_layers)
+	{
+		if(layer<0 || layer>=CellID::n_layer)cout<<"Geometry: layer "<<layer<<" out of range 0-"<<CellID::n_layer-1<<", skipped"<<endl;
+		else active.push_back(layer);
+	}
+	sort(active.begin(),active.end());
+	active.erase(unique(active.begin(),active.end()),active.end());
+	fill(layer_base,layer_base+CellID::n_layer,-1);
+	for(size_t i=0;i<active.size();i++)layer_base[active[i]] = i*chips*n_channel;
+}
+
+string Geometry::Describe() const
+{
+	ostringstream out;
+	out<<active.size()<<" layers (";
+	for(size_t i=0;i<active.size();i++)out<<(i ? " " : "")<<active[i];
+	out<<") x "<<chips<<" chips";
+	return out.str();
+}
+
+Geometry Geometry::Detect(const vector<string> &files,const Long64_t entries)
+{
+	bool seen[CellID::n_layer] = {false};
+	int max_chip = 0;
+	for(auto &fname:files)
+	{
+		RawHitReader reader;
+		if(!reader.Open(fname,{"CellID"}))continue;
+		reader.ForEachEntry([&](Long64_t){
+			for(int cellid:reader.CellID())
+			{
+				const CellID id = CellID::FromDecimal(cellid);
+				if(!id.Valid())continue;
+				seen[id.Layer()] = true;
+				max_chip = max(max_chip,id.Chip());
+			}
+		},0,[entries](Long64_t entry){return entries<0 || entry<entries;});
+	}
+	vector<int> active_layers;
+	for(int layer=0;layer<CellID::n_layer;layer++)
+		if(seen[layer])active_layers.push_back(layer);
+	Geometry geometry(active_layers,max_chip+1);
+	cout<<"Geometry detected: "<<geometry.Describe()<<endl;
+	return geometry;
+}
@@ -1,8 +1,10 @@
 #include "HBase.h"
+#include "TEnv.h"
+#include <mutex>
 
 using namespace std;
 
-HBase::HBase() : fin(0),fout(0),tin(0),tout(0)
+HBase::HBase() : fin(0),fout(0),tin(0),tout(0),b_compact(false),cache_size(30000000),prefetch(true),_bcid16(0),_hitTag8(0),_gainTag8(0),_HG_Charge16(0),_LG_Charge16(0),_Hit_Time16(0)
 {
 		list.clear();
 		cout<<"HBase class instance initialized."<<endl;
@@ -11,8 +13,8 @@ HBase::HBase() : fin(0),fout(0),tin(0),tout(0)
 HBase::~HBase()
 {
 		cout<<"Base destructor called"<<endl;
-		fout->Close();
-		//fin->Close();
+		if(fout)fout->Close();
+		CloseTree();
 }
 
 void HBase::Init(const TString &_outname)
@@ -29,6 +31,11 @@ void HBase::CreateFile(const TString &_outname)
 void HBase::ReadList(const string &_list)
 {
 		ifstream data(_list);
+		if(!data.is_open())
+		{
+				cout<<"cant open "<<_list<<endl;
+				return;
+		}
 		while(!data.eof())
 		{
 				string temp;
@@ -38,24 +45,147 @@ void HBase::ReadList(const string &_list)
 		}
 }
 
+int HBase::DacChannel(const string &fname)
+{
+		string skipchannel = fname.substr(fname.find_last_of('/')+1);
+		size_t n_chn=skipchannel.find("chn");
+		if(n_chn==string::npos)return -1;
+		skipchannel = skipchannel.substr(n_chn+3);
+		skipchannel = skipchannel.substr(0,skipchannel.find_last_of('_'));
+		return stoi(skipchannel);
+}
+
 void HBase::ReadTree(const TString &fname,const TString &tname)
 {
 		cout<<"Reading tree "<<fname<<endl;
+		CloseTree();
 		fin = TFile::Open(TString(fname),"READ");
+		if(!fin || fin->IsZombie())
+		{
+				cout<<"cant open "<<fname<<endl;
+				CloseTree();
+				return;
+		}
 		tin = (TTree*)fin->Get(TString(tname));
-		_cellID=0;_bcid=0;_hitTag=0;_gainTag=0;_cherenkov=0;_HG_Charge=0;_LG_Charge=0;_Hit_Time=0;
+		if(!tin)
+		{
+				cout<<"no tree "<<tname<<" in "<<fname<<endl;
+				return;
+		}
+		TBranch *b_charge = tin->GetBranch("HG_Charge");
+		b_compact = b_charge && TString(b_charge->GetClassName())=="vector<short>";
 		tin->SetBranchAddress("Run_Num",&_Run_No);
 		tin->SetBranchAddress("Event_Time",&_Event_Time);
 		tin->SetBranchAddress("CycleID",&_cycleID);
 		tin->SetBranchAddress("TriggerID",&_triggerID);
 		tin->SetBranchAddress("CellID",&_cellID);
-		tin->SetBranchAddress("BCID",&_bcid);
-		tin->SetBranchAddress("HitTag",&_hitTag);
-		tin->SetBranchAddress("GainTag",&_gainTag);
-		tin->SetBranchAddress("HG_Charge",&_HG_Charge);
-		tin->SetBranchAddress("LG_Charge",&_LG_Charge);
-		tin->SetBranchAddress("Hit_Time",&_Hit_Time);
 		tin->SetBranchAddress("Cherenkov",&_cherenkov);
-		cout<<"Reading tree done "<<fname<<endl;
+		_Pedestal_Sample = 1;
+		if(tin->GetBranch("Pedestal_Sample"))tin->SetBranchAddress("Pedestal_Sample",&_Pedestal_Sample);
+		if(b_compact)
+		{
+			tin->SetBranchAddress("BCID",&_bcid16);
+			tin->SetBranchAddress("HitTag",&_hitTag8);
+			tin->SetBranchAddress("GainTag",&_gainTag8);
+			tin->SetBranchAddress("HG_Charge",&_HG_Charge16);
+			tin->SetBranchAddress("LG_Charge",&_LG_Charge16);
+			tin->SetBranchAddress("Hit_Time",&_Hit_Time16);
+			_bcid=&_bcid_w;_hitTag=&_hitTag_w;_gainTag=&_gainTag_w;
+			_HG_Charge=&_HG_Charge_w;_LG_Charge=&_LG_Charge_w;_Hit_Time=&_Hit_Time_w;
+		}
+		else
+		{
+			tin->SetBranchAddress("BCID",&_bcid);
+			tin->SetBranchAddress("HitTag",&_hitTag);
+			tin->SetBranchAddress("GainTag",&_gainTag);
+			tin->SetBranchAddress("HG_Charge",&_HG_Charge);
+			tin->SetBranchAddress("LG_Charge",&_LG_Charge);
+			tin->SetBranchAddress("Hit_Time",&_Hit_Time);
+		}
+		EnableBranches({});
+		cout<<"Reading tree done "<<fname<<(b_compact?" (compact)":"")<<endl;
 		
 }
+
+Long64_t HBase::GetEntry(const Long64_t entry)
+{
+		Long64_t nbytes = tin->GetEntry(entry);
+		if(b_compact)
+		{
+				// Disabled branches keep their last entry (or were never allocated), only the read ones are widened
+				if(b_read_compact[0])_bcid_w.assign(_bcid16->begin(),_bcid16->end());
+				if(b_read_compact[1])_hitTag_w.assign(_hitTag8->begin(),_hitTag8->end());
+				if(b_read_compact[2])_gainTag_w.assign(_gainTag8->begin(),_gainTag8->end());
+				if(b_read_compact[3])_HG_Charge_w.assign(_HG_Charge16->begin(),_HG_Charge16->end());
+				if(b_read_compact[4])_LG_Charge_w.assign(_LG_Charge16->begin(),_LG_Charge16->end());
+				if(b_read_compact[5])_Hit_Time_w.assign(_Hit_Time16->begin(),_Hit_Time16->end());
+		}
+		return nbytes;
+}
+
+int HBase::OpenTree(const TString &fname,const TString &tname,const vector<string> &names)
+{
+		ReadTree(fname,tname);
+		if(!tin)return 0;
+		EnableBranches(names);
+		return 1;
+}
+
+void HBase::EnableBranches(const vector<string> &names)
+{
+		tin->SetBranchStatus("*",names.empty());
+		for(auto &name:names)tin->SetBranchStatus(name.c_str(),1);
+		const bool b_sample = tin->GetBranch("Pedestal_Sample");
+		if(b_sample)tin->SetBranchStatus("Pedestal_Sample",1);
+		const char *compact_names[6]={"BCID","HitTag","GainTag","HG_Charge","LG_Charge","Hit_Time"};
+		for(int i=0;i<6;i++)b_read_compact[i]=tin->GetBranchStatus(compact_names[i]);
+		// A new cache holding exactly the enabled branches, no learning phase
+		tin->SetCacheSize(0);
+		if(cache_size<=0)return;
+		{
+				// The cache takes TFile.AsyncPrefetching when it is made, so it is set to prefetch for this
+				// cache only and put back: other readers, also the pool workers of PedestalManager, keep their own
+				static mutex prefetch_mutex;
+				lock_guard<mutex> lock(prefetch_mutex);
+				const int previous = gEnv->GetValue("TFile.AsyncPrefetching",0);
+				gEnv->SetValue("TFile.AsyncPrefetching",prefetch ? 1 : 0);
+				tin->SetCacheSize(cache_size);
+				gEnv->SetValue("TFile.AsyncPrefetching",previous);
+		}
+		if(names.empty())tin->AddBranchToCache("*",true);
+		for(auto &name:names)tin->AddBranchToCache(name.c_str(),true);
+		if(b_sample && !names.empty())tin->AddBranchToCache("Pedestal_Sample",true);
+		tin->StopCacheLearningPhase();
+}
+
+void HBase::CloseTree()
+{
+		if(fin)
+		{
+				fin->Close();
+				delete fin;
+		}
+		fin=0;tin=0;
+		_cellID=0;_bcid=0;_hitTag=0;_gainTag=0;_cherenkov=0;_HG_Charge=0;_LG_Charge=0;_Hit_Time=0;
+		_bcid16=0;_hitTag8=0;_gainTag8=0;_HG_Charge16=0;_LG_Charge16=0;_Hit_Time16=0;
+}
+
+Long64_t HBase::ForEachEntry(const function<void(Long64_t)> &f,const Long64_t first,const function<bool(Long64_t)> &select)
+{
+		const Long64_t n = tin->GetEntries();
+		Long64_t nread = 0;
+		TTree::TClusterIterator clusters = tin->GetClusterIterator(first);
+		Long64_t begin;
+		while((begin=clusters())<n)
+		{
+				const Long64_t end = min(clusters.GetNextEntry(),n);
+				for(Long64_t entry=max(begin,first);entry<end;entry++)
+				{
+						if(select && !select(entry))continue;
+						GetEntry(entry);
+						f(entry);
+						nread++;
+				}
+		}
+		return nread;
+}
@@ -0,0 +1,61 @@
+#include "MappedFile.h"
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+MappedFile::MappedFile() : _fd(-1),_data(nullptr),_size(0),_released(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+int MappedFile::Open(const string &fname)
+{
+	Close();
+	_fd = open(fname.c_str(),O_RDONLY);
+	if(_fd<0) return 0;
+	struct stat st;
+	if(fstat(_fd,&st)!=0 || !S_ISREG(st.st_mode))
+	{
+		Close();
+		return 0;
+	}
+	_size = st.st_size;
+	if(_size==0) return 1; // Nothing to map, but the file is valid
+	void *addr = mmap(nullptr,_size,PROT_READ,MAP_PRIVATE,_fd,0);
+	if(addr==MAP_FAILED)
+	{
+		cout<<"MappedFile: mmap failed for "<<fname<<endl;
+		Close();
+		return 0;
+	}
+	_data = (unsigned char*)addr;
+	madvise(_data,_size,MADV_SEQUENTIAL);
+	return 1;
+}
+
+void MappedFile::Close()
+{
+	if(_data) munmap(_data,_size);
+	if(_fd>=0) close(_fd);
+	_fd = -1;
+	_data = nullptr;
+	_size = 0;
+	_released = 0;
+}
+
+void MappedFile::Release(const size_t offset)
+{
+	if(!_data || offset<_released+release_step) return;
+	const size_t page = sysconf(_SC_PAGESIZE);
+	size_t end = offset/page*page;
+	madvise(_data+_released,end-_released,MADV_DONTNEED);
+	_released = end;
+}
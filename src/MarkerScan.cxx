@@ -0,0 +1,197 @@
+#include "MarkerScan.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MARKERSCAN_X86
+#endif
+
+using namespace std;
+
+// All four markers have the form b0 b1 b0 b1 (fbee fbee, fedd fedd, fa5a fa5a, feee feee).
+// The vector kernels look for a known (b0,b1) pair that is repeated two bytes later and
+// classify the few candidates with a scalar compare.
+namespace{
+
+	inline unsigned int ReadWord(const unsigned char *p)
+	{
+		return (unsigned int)p[0]<<24 | (unsigned int)p[1]<<16 | (unsigned int)p[2]<<8 | (unsigned int)p[3];
+	}
+
+	inline int MarkerOf(const unsigned char *p)
+	{
+		const unsigned int word = ReadWord(p);
+		for(int t=0;t<kMarkerTypes;t++) if(word==marker_word[t]) return t;
+		return -1;
+	}
+
+	size_t FindMarker_scalar(const unsigned char *data, const size_t size, const unsigned int word, size_t i=0)
+	{
+		const unsigned char b0 = word>>24;
+		for(;i+4<=size;i++) if(data[i]==b0 && ReadWord(data+i)==word) return i;
+		return size;
+	}
+
+	void ScanMarkers_scalar(const unsigned char *data, const size_t size, vector<BagMarker> &markers, size_t i=0)
+	{
+		for(;i+4<=size;i++)
+		{
+			if(data[i]!=data[i+2] || data[i+1]!=data[i+3]) continue;
+			int type = MarkerOf(data+i);
+			if(type>=0) markers.push_back({i,type});
+		}
+	}
+
+#ifdef MARKERSCAN_X86
+	__attribute__((target("sse2")))
+	size_t FindMarker_sse2(const unsigned char *data, const size_t size, const unsigned int word)
+	{
+		const __m128i b0 = _mm_set1_epi8((char)(word>>24));
+		const __m128i b1 = _mm_set1_epi8((char)(word>>16));
+		const __m128i b3 = _mm_set1_epi8((char)word);
+		size_t i=0;
+		for(;i+16+3<=size;i+=16)
+		{
+			__m128i m = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data+i)),b0),
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data+i+1)),b1));
+			m = _mm_and_si128(m,_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data+i+3)),b3));
+			unsigned int bits = _mm_movemask_epi8(m);
+			for(;bits;bits&=bits-1)
+			{
+				size_t k = i+__builtin_ctz(bits);
+				if(ReadWord(data+k)==word) return k;
+			}
+		}
+		return FindMarker_scalar(data,size,word,i);
+	}
+
+	__attribute__((target("sse2")))
+	void ScanMarkers_sse2(const unsigned char *data, const size_t size, vector<BagMarker> &markers)
+	{
+		__m128i b0[kMarkerTypes],b1[kMarkerTypes];
+		for(int t=0;t<kMarkerTypes;t++)
+		{
+			b0[t] = _mm_set1_epi8((char)(marker_word[t]>>24));
+			b1[t] = _mm_set1_epi8((char)(marker_word[t]>>16));
+		}
+		size_t i=0;
+		for(;i+16+3<=size;i+=16)
+		{
+			const __m128i v0 = _mm_loadu_si128((const __m128i*)(data+i));
+			const __m128i v1 = _mm_loadu_si128((const __m128i*)(data+i+1));
+			const __m128i v2 = _mm_loadu_si128((const __m128i*)(data+i+2));
+			const __m128i v3 = _mm_loadu_si128((const __m128i*)(data+i+3));
+			__m128i pair = _mm_setzero_si128();
+			for(int t=0;t<kMarkerTypes;t++)
+				pair = _mm_or_si128(pair,_mm_and_si128(_mm_cmpeq_epi8(v0,b0[t]),_mm_cmpeq_epi8(v1,b1[t])));
+			const __m128i repeat = _mm_and_si128(_mm_cmpeq_epi8(v0,v2),_mm_cmpeq_epi8(v1,v3));
+			unsigned int bits = _mm_movemask_epi8(_mm_and_si128(pair,repeat));
+			for(;bits;bits&=bits-1)
+			{
+				size_t k = i+__builtin_ctz(bits);
+				markers.push_back({k,MarkerOf(data+k)});
+			}
+		}
+		ScanMarkers_scalar(data,size,markers,i);
+	}
+
+	__attribute__((target("avx2")))
+	size_t FindMarker_avx2(const unsigned char *data, const size_t size, const unsigned int word)
+	{
+		const __m256i b0 = _mm256_set1_epi8((char)(word>>24));
+		const __m256i b1 = _mm256_set1_epi8((char)(word>>16));
+		const __m256i b3 = _mm256_set1_epi8((char)word);
+		size_t i=0;
+		for(;i+32+3<=size;i+=32)
+		{
+			__m256i m = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data+i)),b0),
+					_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data+i+1)),b1));
+			m = _mm256_and_si256(m,_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data+i+3)),b3));
+			unsigned int bits = _mm256_movemask_epi8(m);
+			for(;bits;bits&=bits-1)
+			{
+				size_t k = i+__builtin_ctz(bits);
+				if(ReadWord(data+k)==word) return k;
+			}
+		}
+		return FindMarker_scalar(data,size,word,i);
+	}
+
+	__attribute__((target("avx2")))
+	void ScanMarkers_avx2(const unsigned char *data, const size_t size, vector<BagMarker> &markers)
+	{
+		__m256i b0[kMarkerTypes],b1[kMarkerTypes];
+		for(int t=0;t<kMarkerTypes;t++)
+		{
+			b0[t] = _mm256_set1_epi8((char)(marker_word[t]>>24));
+			b1[t] = _mm256_set1_epi8((char)(marker_word[t]>>16));
+		}
+		size_t i=0;
+		for(;i+32+3<=size;i+=32)
+		{
+			const __m256i v0 = _mm256_loadu_si256((const __m256i*)(data+i));
+			const __m256i v1 = _mm256_loadu_si256((const __m256i*)(data+i+1));
+			const __m256i v2 = _mm256_loadu_si256((const __m256i*)(data+i+2));
+			const __m256i v3 = _mm256_loadu_si256((const __m256i*)(data+i+3));
+			__m256i pair = _mm256_setzero_si256();
+			for(int t=0;t<kMarkerTypes;t++)
+				pair = _mm256_or_si256(pair,_mm256_and_si256(_mm256_cmpeq_epi8(v0,b0[t]),_mm256_cmpeq_epi8(v1,b1[t])));
+			const __m256i repeat = _mm256_and_si256(_mm256_cmpeq_epi8(v0,v2),_mm256_cmpeq_epi8(v1,v3));
+			unsigned int bits = _mm256_movemask_epi8(_mm256_and_si256(pair,repeat));
+			for(;bits;bits&=bits-1)
+			{
+				size_t k = i+__builtin_ctz(bits);
+				markers.push_back({k,MarkerOf(data+k)});
+			}
+		}
+		ScanMarkers_scalar(data,size,markers,i);
+	}
+#endif
+
+	size_t FindMarker_generic(const unsigned char *data, const size_t size, const unsigned int word)
+	{
+		return FindMarker_scalar(data,size,word);
+	}
+
+	void ScanMarkers_generic(const unsigned char *data, const size_t size, vector<BagMarker> &markers)
+	{
+		ScanMarkers_scalar(data,size,markers);
+	}
+
+	struct MarkerKernel
+	{
+		size_t (*find)(const unsigned char*,const size_t,const unsigned int);
+		void (*scan)(const unsigned char*,const size_t,vector<BagMarker>&);
+		const char *isa;
+	};
+
+	MarkerKernel SelectKernel()
+	{
+#ifdef MARKERSCAN_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) return {FindMarker_avx2,ScanMarkers_avx2,"avx2"};
+		if(__builtin_cpu_supports("sse2")) return {FindMarker_sse2,ScanMarkers_sse2,"sse2"};
+#endif
+		return {FindMarker_generic,ScanMarkers_generic,"scalar"};
+	}
+
+	const MarkerKernel &Kernel()
+	{
+		static const MarkerKernel kernel = SelectKernel();
+		return kernel;
+	}
+}
+
+size_t FindMarker(const unsigned char *data, const size_t size, const MarkerType type)
+{
+	return Kernel().find(data,size,marker_word[type]);
+}
+
+void ScanMarkers(const unsigned char *data, const size_t size, vector<BagMarker> &markers)
+{
+	markers.clear();
+	Kernel().scan(data,size,markers);
+}
+
+const char *MarkerScanISA()
+{
+	return Kernel().isa;
+}
@@ -7,9 +7,17 @@
 #include <TCanvas.h>
 #include <sstream>
 #include <algorithm>
+#include <stdexcept>
 #include "TSpectrum.h"
+#include "CellHistStore.h"
+#include "ThreadPool.h"
+#include "RawHitFrame.h"
+#include "RawHitReader.h"
+#include "PedestalSelection.h"
+#include "FitScope.h"
 
 using namespace std;
+using ROOT::VecOps::RVec;
 bool compare(double a, double b){
 	return a<b;
 }
@@ -39,10 +47,11 @@ void PedestalManager::DeleteInstance()
 	else
 	{
 		delete _instance;
+		_instance = nullptr;
 	}
 }
 
-PedestalManager::PedestalManager()
+PedestalManager::PedestalManager() : hist_highgain(1500),hist_lowgain(1600)
 {
 	list.clear();
 	cout<<"PedestalManager class instance initialized."<<endl;
@@ -57,38 +66,31 @@ void PedestalManager::Init(const TString &_outname)
 	tout->Branch("highgain_rms",&highgain_rms);
 	tout->Branch("lowgain_peak",&lowgain_peak);
 	tout->Branch("lowgain_rms",&lowgain_rms);
-	highgainpeak=std::make_unique<TH2D>("highgainpeak","HighGain Peak",360,0,360,36,0,36);
-	highgainrms=std::make_unique<TH2D>("highgainrms","HighGain RMS",360,0,360,36,0,36);
-	lowgainpeak=std::make_unique<TH2D>("lowgainpeak","LowGain Peak",360,0,360,36,0,36);
-	lowgainrms=std::make_unique<TH2D>("lowgainrms","LowGain RMS",360,0,360,36,0,36);
-	int ini_cellid=0;
-	for(int i_layer=0;i_layer<40;i_layer++)
-	{
-		for(int i_chip=0;i_chip<9;i_chip++)
-		{
-			for(int i_chn=0;i_chn<36;i_chn++)
-			{
-				ini_cellid=i_layer*100000+i_chip*10000+i_chn;
-				vec_cellid.push_back(ini_cellid);
-				TString highgainname="highgain_"+TString(to_string(ini_cellid).c_str());
-				map_cellid_highgain[ini_cellid] = new TH1D(highgainname,highgainname,1500,0,1500);
-				TString lowgainname="lowgain_"+TString(to_string(ini_cellid).c_str());
-				map_cellid_lowgain[ini_cellid] = new TH1D(lowgainname,lowgainname,1600,0,1600);
-			}
-		}
-	}
-	for(int i=0;i<40;i++)
+	cout<<"Initialization done"<<endl;
+}
+
+void PedestalManager::Book()
+{
+	cout<<"Pedestal geometry: "<<geometry.Describe()<<endl;
+	const int nx = geometry.Layers()*geometry.Chips();
+	const int chips = geometry.Chips();
+	highgainpeak=std::make_unique<TH2D>("highgainpeak","HighGain Peak",nx,0,nx,36,0,36);
+	highgainrms=std::make_unique<TH2D>("highgainrms","HighGain RMS",nx,0,nx,36,0,36);
+	lowgainpeak=std::make_unique<TH2D>("lowgainpeak","LowGain Peak",nx,0,nx,36,0,36);
+	lowgainrms=std::make_unique<TH2D>("lowgainrms","LowGain RMS",nx,0,nx,36,0,36);
+	hist_highgain=CellHistStore(1500,geometry.Cells());
+	hist_lowgain=CellHistStore(1600,geometry.Cells());
+	for(int i:geometry.ActiveLayers())
 	{
 		TString name_highgainpeak="highgainpeak_"+TString(to_string(i).c_str());
-		map_layer_highgainpeak[i] = new TH2D(name_highgainpeak,name_highgainpeak,9,0,9,36,0,36);
+		map_layer_highgainpeak[i] = new TH2D(name_highgainpeak,name_highgainpeak,chips,0,chips,36,0,36);
 		TString name_highgainrms="highgainrms_"+TString(to_string(i).c_str());
-		map_layer_highgainrms[i] = new TH2D(name_highgainrms,name_highgainrms,9,0,9,36,0,36);
+		map_layer_highgainrms[i] = new TH2D(name_highgainrms,name_highgainrms,chips,0,chips,36,0,36);
 		TString name_lowgainpeak="lowgainpeak_"+TString(to_string(i).c_str());
-		map_layer_lowgainpeak[i] = new TH2D(name_lowgainpeak,name_lowgainpeak,9,0,9,36,0,36);
+		map_layer_lowgainpeak[i] = new TH2D(name_lowgainpeak,name_lowgainpeak,chips,0,chips,36,0,36);
 		TString name_lowgainrms="lowgainrms_"+TString(to_string(i).c_str());
-		map_layer_lowgainrms[i] = new TH2D(name_lowgainrms,name_lowgainrms,9,0,9,36,0,36);
+		map_layer_lowgainrms[i] = new TH2D(name_lowgainrms,name_lowgainrms,chips,0,chips,36,0,36);
 	}
-	cout<<"Initialization done"<<endl;
 }
 
 int PedestalManager::AnaPedestal(const std::string &_list,const int &sel_hittag)
@@ -97,275 +99,322 @@ int PedestalManager::AnaPedestal(const std::string &_list,const int &sel_hittag)
 	cout<<"Ana preparation done"<<endl;
 	ReadList(_list); // read file list _list to list
 	cout<<"read list done"<<endl;
+	if(list.empty())
+	{
+		cout<<"no files in "<<_list<<endl;
+		return 0;
+	}
+	if(detect_entries!=0)geometry=Geometry::Detect(list,detect_entries);
+	Book();
 	cout<<usemt<<" usemt"<<endl;
-	if(usemt){
-		ROOT::EnableImplicitMT();
-		ROOT::EnableThreadSafety();
-		const int nthreads = 10;
-		thread t[nthreads];
-		vector<vector<string>> listth;
-		int nfile_pert = list.size()/nthreads +1;
-		if(list.size()%nthreads == 0)nfile_pert--;
-		auto f = [this,sel_hittag](vector<string> list_tmp)
-		{
-			for(auto tmp:list_tmp)
+	int filled = 1;
+	if(engine=="compare")filled = CompareEngines(sel_hittag);
+	else if(engine=="rdf")filled = FillFiles(sel_hittag,true);
+	else if(usemt)filled = FillFiles(sel_hittag,false);
+	else filled = FillSerial(sel_hittag);
+	if(!filled)
+	{
+		cout<<"Pedestal fill failed, nothing written"<<endl;
+		return 0;
+	}
+	// Analysis done
+	//
+	return WritePedestal();
+}
+
+// One file in entry order with the PedestalSelection cuts: a light pass over Event_Time tells the
+// complete events, then only the hits of the selected ones are read
+void PedestalManager::FillFile(const string &file,const int sel_hittag,CellHistStore &highgain,CellHistStore &lowgain) const
+{
+	RawHitReader reader;
+	reader.SetReadCache(cache_size,prefetch);
+	if(!reader.Open(file,{"Event_Time"}))throw runtime_error("cant read Raw_Hit of "+file);
+	vector<unsigned int> event_time;
+	vector<char> sampled;
+	reader.ForEachEntry([&](Long64_t){
+		event_time.push_back(reader.EventTime());
+		sampled.push_back(reader.PedestalSample());
+	});
+	const vector<char> complete = PedestalSelection::Complete(event_time);
+	PedestalSelection selection(geometry,sel_hittag,sel_hittag==1 ? DacChannel(file) : -1); // The DAC channel is not used for pedestals
+	reader.EnableBranches({"CellID","HitTag","HG_Charge","LG_Charge"});
+	reader.ForEachEntry([&](Long64_t){
+		const vector<int> &hitTag = reader.HitTag();
+		const vector<int> &cellID = reader.CellID();
+		const vector<double> &HG_Charge = reader.HG_Charge();
+		const vector<double> &LG_Charge = reader.LG_Charge();
+		for(size_t i=0;i<hitTag.size();i++)selection.Hit(hitTag[i],cellID[i],HG_Charge[i],LG_Charge[i],highgain,lowgain);
+	},0,[&](Long64_t ientry){return selection.Event(complete[ientry],sampled[ientry]);});
+}
+
+// FillFile on RDataFrame: one file on one slot, so the events arrive in file order
+void PedestalManager::FillFileRDF(const string &file,const int sel_hittag,CellHistStore &highgain,CellHistStore &lowgain) const
+{
+	RawHitFrame frame({file},1);
+	if(frame.Slots()!=1)throw runtime_error("implicit multithreading is on, the events of "+file+" would not be in order");
+	ROOT::RDF::RNode node = frame.Node();
+	if(node.HasColumn("Pedestal_Sample"))node = node.Alias("sampled","Pedestal_Sample");
+	else node = node.Define("sampled",[]{return 1;});
+	const vector<char> complete = PedestalSelection::Complete(*node.Take<unsigned int>("Event_Time"));
+	PedestalSelection selection(geometry,sel_hittag,sel_hittag==1 ? DacChannel(file) : -1);
+	node.Foreach([&](ULong64_t file_entry,int sampled,const RVec<int> &hitTag,const RVec<int> &cellID,const RVec<double> &HG_Charge,const RVec<double> &LG_Charge){
+		if(!selection.Event(complete[file_entry],sampled!=0))return;
+		for(size_t i=0;i<hitTag.size();i++)selection.Hit(hitTag[i],cellID[i],HG_Charge[i],LG_Charge[i],highgain,lowgain);
+	},{"file_entry","sampled","hittag","CellID","hg","lg"});
+}
+
+// The files one after another into hist_highgain and hist_lowgain, 0 if one failed
+int PedestalManager::FillSerial(const int sel_hittag)
+{
+	try
+	{
+		for(auto &file:list)FillFile(file,sel_hittag,hist_highgain,hist_lowgain);
+	}
+	catch(exception &e)
+	{
+		cout<<"Pedestal fill failed: "<<e.what()<<endl;
+		return 0;
+	}
+	return 1;
+}
+
+// Every file is read on a pool worker with its own reader, hits go to the worker's private count
+// store without locking, and the stores are merged in worker order. 0 if a file failed.
+int PedestalManager::FillFiles(const int sel_hittag,const bool rdf)
+{
+	ROOT::EnableThreadSafety();
+	const size_t store_bytes = WorkerBytes(geometry);
+	ThreadPool pool(CellHistStore::WorkersInMemory(ThreadPool::Resolve(nthreads),store_bytes));
+	cout<<"Pedestal threads: "<<pool.Size()<<(rdf?" (rdf)":"")<<", "<<pool.Size()*store_bytes/1048576<<" MB of counts"<<endl;
+	worker_highgain.assign(pool.Size(),CellHistStore(1500,geometry.Cells()));
+	worker_lowgain.assign(pool.Size(),CellHistStore(1600,geometry.Cells()));
+	atomic<bool> failed(false);
+	for(auto &file:list)
+	{
+		pool.Submit([this,file,sel_hittag,rdf,&failed]{
+			CellHistStore &highgain = worker_highgain[ThreadPool::WorkerIndex()];
+			CellHistStore &lowgain = worker_lowgain[ThreadPool::WorkerIndex()];
+			try
 			{
-				string skipchannel = tmp;
-				int dac_chn=-1;// Which channel should not be used here for pedestal analysis
-				if(sel_hittag == 1)
-				{
-					skipchannel = skipchannel.substr(skipchannel.find_last_of('/')+1);
-					skipchannel = skipchannel.substr(skipchannel.find("chn")+3);
-					skipchannel = skipchannel.substr(0,skipchannel.find_last_of('_'));
-						dac_chn = stoi(skipchannel);
-				}
-				this->ReadTree(TString(tmp.c_str()),"Raw_Hit");
-				int Nentry = tin->GetEntries();
-				for(int ientry=0;ientry<Nentry;ientry++)
-				{
-					tin->GetEntry(ientry);
-					for(int i=0;i<_hitTag->size();i++)
-					{
-						if(_hitTag->at(i)!=sel_hittag)continue;
-						int cellid = _cellID->at(i);
-						int channel = cellid%100;
-						int memo = (cellid%10000)/100;
-						if(memo !=0 )continue;
-						if(dac_chn==channel)continue;
-						int layer = cellid/1e5;
-						mtx.lock();
-						map_cellid_highgain[cellid]->Fill(_HG_Charge->at(i));
-						map_cellid_lowgain[cellid]->Fill(_LG_Charge->at(i));
-						mtx.unlock();
-					}
-				}
+				if(rdf)FillFileRDF(file,sel_hittag,highgain,lowgain);
+				else FillFile(file,sel_hittag,highgain,lowgain);
 			}
-		};
-		for(int ith=0;ith<nthreads;ith++)
-		{
-			int begin = ith*nfile_pert;
-			int end = begin + nfile_pert - 1;
-			end = end>list.size()-1? list.size()-1 : end;
-			vector<string> tmp_list;
-			for(int i=begin;i<=end;i++)tmp_list.push_back(list.at(i));
-			listth.push_back(tmp_list);
-		}
-		for(int ith=0;ith<nthreads;ith++)
+			catch(exception &e)
+			{
+				cout<<"Pedestal fill of "<<file<<" failed: "<<e.what()<<endl;
+				failed = true;
+			}
+		});
+	}
+	pool.Wait();
+	MergeWorkers();
+	return failed ? 0 : 1;
+}
+
+namespace{
+	// Bins that differ between the counts of two engines, the first cells with any are printed
+	size_t CompareStores(const char *name,const CellHistStore &native,const CellHistStore &rdf,const Geometry &geometry)
+	{
+		size_t n_bins=0;
+		int n_cells=0;
+		for(int index=0;index<native.Cells();index++)
 		{
-			async(launch::async,f,listth.at(ith));
-			//t[ith] = thread(f,listth.at(ith));
+			const uint32_t *a=native.Counts(index),*b=rdf.Counts(index);
+			size_t n=0;
+			for(int bin=0;bin<native.Bins()+2;bin++)if(a[bin]!=b[bin])n++;
+			if(n==0)continue;
+			if(n_cells<10)cout<<name<<" cell "<<geometry.FromIndex(index).Decimal()<<": "<<n<<" bins differ"<<endl;
+			n_cells++;
+			n_bins+=n;
 		}
-		//for(int i=0;i<nthreads;i++)
-		//{
-		//	if(t[i].joinable())t[i].join();
-		//}
+		cout<<name<<" native vs rdf: "<<n_bins<<" bins of "<<n_cells<<" cells differ"<<endl;
+		return n_bins;
 	}
-	else
+}
+
+// Engine compare: the native fill (usemt or serial) and the rdf one, bin by bin. The native counts are kept.
+int PedestalManager::CompareEngines(const int sel_hittag)
+{
+	if(usemt)
 	{
-		for_each(list.begin(),list.end(),[this,sel_hittag](string tmp){
-				string skipchannel = tmp;
-				int dac_chn=-1;// Which channel should not be used here for pedestal analysis
-				if(sel_hittag == 1){
-					skipchannel = skipchannel.substr(skipchannel.find_last_of('/')+1);
-					int n_chn=skipchannel.find("chn");
-					if(n_chn!=-1){
-						skipchannel = skipchannel.substr(n_chn+3);
-						skipchannel = skipchannel.substr(0,skipchannel.find_last_of('_'));
-						dac_chn = stoi(skipchannel);
-					}
-				}
-				this->ReadTree(TString(tmp.c_str()),"Raw_Hit");
-				int Nentry = tin->GetEntries();
-				int flag[9][40]={0};
-				tin->GetEntry(Nentry-1);
-				if(_Event_Time<=0)tin->GetEntry(Nentry-2);
-				if(_Event_Time<=0)tin->GetEntry(Nentry-3);
-				TH1I *Event_Time = new TH1I("Event_Time","Event_Time",_Event_Time,0,_Event_Time);
-				for(int i=0;i<Nentry;i++){
-				tin->GetEntry(i);
-				Event_Time->Fill(_Event_Time);
-				}
-				for(int ientry=0;ientry<Nentry;ientry++){
-					tin->GetEntry(ientry);
-					if(Event_Time->GetBinContent(_Event_Time)<10){
-						for(int j=0;j<9;j++)
-							for(int p=0;p<40;p++)
-								flag[j][p]=0;
-						continue;
-					}
-					for(int i=0;i<_hitTag->size();i++){
-						if(_hitTag->at(i)!=sel_hittag)continue;
-						int cellid = _cellID->at(i);
-						int channel = cellid%100;
-						int memo = (cellid%10000)/100;
-						if(memo !=0 )continue;
-						if(dac_chn==channel)continue;
-						int layer = cellid/1e5;
-						int chip = (cellid%100000)/10000;
-						// if(times->at(i)<time_min)time_min=times->at(i);
-						// if(times->at(i)>time_max)time_max=times->at(i);
-						// if(lowgains->at(i)<lowgain_min)lowgain_min=lowgains->at(i);
-						// if(lowgains->at(i)>lowgain_max)lowgain_max=lowgains->at(i);
-						// if(Event_Time->GetBinContent(_Event_Time-1)<10||_Event_Time==0)
-						flag[chip][layer]+=1;
-						if(flag[chip][layer]>36){
-							if(_HG_Charge->at(i)>100)map_cellid_highgain[cellid]->Fill(_HG_Charge->at(i));
-							if(_LG_Charge->at(i)>100)map_cellid_lowgain[cellid]->Fill(_LG_Charge->at(i));
-						}
-					}
-				}
-		}
-		);
+		if(!FillFiles(sel_hittag,false))return 0;
 	}
-	// Analysis done
-	//
-	// Fill the output tree
-	for_each(vec_cellid.begin(),vec_cellid.end(),
-			[this](int i)->void{
-			_cellid = i ;
-			highgain_peak=map_cellid_highgain[i]->GetBinCenter(map_cellid_highgain[i]->GetMaximumBin());
-			highgain_rms=map_cellid_highgain[i]->GetRMS();
-			double gap = 3*highgain_rms;
-			TF1 *f1=new TF1("f1","gaus");
-			TSpectrum *s;
-			s= new TSpectrum(4);
-			int npeaks = s->Search(map_cellid_highgain[i],maxx(1,highgain_rms/4),"nobackground",0.2);
-			double *xpeaks = s->GetPositionX();
-			sort(xpeaks,xpeaks+npeaks,compare);
-			if(npeaks>1){
-			gap=xpeaks[1]-xpeaks[0];
-			for(int p=1;p<npeaks-1;p++){
-			gap=minn(gap , xpeaks[p+1]-xpeaks[p]);
-			}
+	else if(!FillSerial(sel_hittag))return 0;
+	const CellHistStore native_highgain = hist_highgain;
+	const CellHistStore native_lowgain = hist_lowgain;
+	hist_highgain.Clear();
+	hist_lowgain.Clear();
+	if(!FillFiles(sel_hittag,true))return 0;
+	const size_t n_diff = CompareStores("highgain",native_highgain,hist_highgain,geometry)+CompareStores("lowgain",native_lowgain,hist_lowgain,geometry);
+	cout<<"Pedestal engines "<<(n_diff==0 ? "agree" : "DIFFER")<<" bin by bin"<<endl;
+	hist_highgain = native_highgain;
+	hist_lowgain = native_lowgain;
+	return 1;
+}
+
+namespace{
+	// PedestalSelection of one decoded file, fed event by event. Whether an event is complete depends on
+	// how many events of the file share its Event_Time, which a stream only knows once the run of
+	// consecutive events with that time reaches min_same_time or ends. Up to min_same_time-1 events of a
+	// run are kept until then. The decoder sees every channel, so every event counts as sampled.
+	// Readout cycles give one run per Event_Time; a time coming back after its run is counted with the
+	// earlier events, and reported once as the Raw_Hit fill might have decided an earlier run differently.
+	class DecodedPedestalFile
+	{
+	public:
+		DecodedPedestalFile(const Geometry &geometry,const int hittag,const int dac_chn,const string &_dat_file) :
+			selection(geometry,hittag,dac_chn),dat_file(_dat_file){}
+
+		void Event(const EventChunk &chunk,const size_t hit_begin,const size_t hit_end,const unsigned int event_time,CellHistStore &highgain,CellHistStore &lowgain)
+		{
+			if(length==0 || event_time!=time)Start(event_time);
+			length++;
+			if(before+length<PedestalSelection::min_same_time)
+			{
+				pending.push_back({vector<int>(chunk.hitTag.begin()+hit_begin,chunk.hitTag.begin()+hit_end),
+					vector<int>(chunk.cellID.begin()+hit_begin,chunk.cellID.begin()+hit_end),
+					vector<double>(chunk.HG_Charge.begin()+hit_begin,chunk.HG_Charge.begin()+hit_end),
+					vector<double>(chunk.LG_Charge.begin()+hit_begin,chunk.LG_Charge.begin()+hit_end)});
+				return;
 			}
-			highgain_rms=minn(0.5*gap , 1.5*maxx(highgain_rms,2));
-			// highgain_rms=(highgain_rms>2)?highgain_rms:2;
-			// highgain_rms=(highgain_rms<5)?highgain_rms:5;
-			for(int n=0;n<4;n++){
-				map_cellid_highgain[i]->Fit(f1,"q","",highgain_peak-highgain_rms,highgain_peak+highgain_rms);
-				// highgain_peak=f1->GetParameter(1);
-				highgain_rms=f1->GetParameter(2);
-				highgain_rms=minn(0.5*gap , 1.5*maxx(highgain_rms,2));
-				// highgain_rms=(highgain_rms>2)?highgain_rms:2;
-				// highgain_rms=(highgain_rms<5)?highgain_rms:5;
+			for(auto &event:pending)
+			{
+				selection.Event(true,true);
+				for(size_t i=0;i<event.hitTag.size();i++)selection.Hit(event.hitTag[i],event.cellID[i],event.highgain[i],event.lowgain[i],highgain,lowgain);
 			}
-			highgain_peak=f1->GetParameter(1);
-			highgain_rms=f1->GetParameter(2);
-			// if(highgain_rms>4.5){
-			// highgain_peak=map_cellid_highgain[i]->GetBinCenter(map_cellid_highgain[i]->GetMaximumBin());
-			// highgain_rms=map_cellid_highgain[i]->GetRMS();
-			// highgain_rms=(highgain_rms>2)?highgain_rms:2;
-			// highgain_rms=(highgain_rms<5)?highgain_rms:5;
-			// for(int n=0;n<3;n++){
-			// map_cellid_highgain[i]->Fit(f1,"q","",highgain_peak-0.8*highgain_rms,highgain_peak+0.8*highgain_rms);
-			// highgain_peak=f1->GetParameter(1);
-			// highgain_rms=f1->GetParameter(2);
-			// highgain_rms=(highgain_rms>2)?highgain_rms:2;
-			// highgain_rms=(highgain_rms<5)?highgain_rms:5;
-			// }
-			// }
-			// highgain_rms=f1->GetParameter(2);
-
-			lowgain_peak=map_cellid_lowgain[i]->GetBinCenter(map_cellid_lowgain[i]->GetMaximumBin());
-			lowgain_rms=map_cellid_lowgain[i]->GetRMS();
-			gap=3*lowgain_rms;
-			npeaks = s->Search(map_cellid_lowgain[i],maxx(1,lowgain_rms/4),"nobackground",0.2);
-			xpeaks = s->GetPositionX();
-			sort(xpeaks,xpeaks+npeaks,compare);
-			if(npeaks>1){
-				gap=xpeaks[1]-xpeaks[0];
-				for(int p=1;p<npeaks-1;p++){
-					gap=minn(gap,xpeaks[p+1]-xpeaks[p]);
-				}
+			pending.clear();
+			selection.Event(true,true);
+			for(size_t i=hit_begin;i<hit_end;i++)selection.Hit(chunk.hitTag[i],chunk.cellID[i],chunk.HG_Charge[i],chunk.LG_Charge[i],highgain,lowgain);
+		}
+
+	private:
+		struct Hits
+		{
+			vector<int> hitTag,cellID;
+			vector<double> highgain,lowgain;
+		};
+		PedestalSelection selection;
+		string dat_file;
+		unsigned int time=0;
+		int before=0; // Events with this time in earlier runs
+		int length=0; // Events of the current run
+		vector<Hits> pending; // Events of the current run while it is not complete
+		unordered_map<unsigned int,int> ended; // Events per Event_Time of the runs that ended
+		bool reported=false;
+
+		// The run before ends: if it stayed incomplete, its events reset the chip counts and are dropped
+		void Start(const unsigned int event_time)
+		{
+			if(length>0)
+			{
+				if(!pending.empty())selection.Event(false,true);
+				pending.clear();
+				ended[time] = before+length;
 			}
-			lowgain_rms=minn(0.5*gap,1.5*maxx(lowgain_rms,2));
-			// lowgain_rms=(lowgain_rms>2)?lowgain_rms:2;
-			// lowgain_rms=(lowgain_rms<5)?lowgain_rms:5;
-			for(int n=0;n<4;n++){
-				map_cellid_lowgain[i]->Fit(f1,"q","",lowgain_peak-lowgain_rms,lowgain_peak+lowgain_rms);
-				// lowgain_peak=f1->GetParameter(1);
-				lowgain_rms=f1->GetParameter(2);
-				lowgain_rms=minn(0.5*gap,1.5*maxx(lowgain_rms,2));
-				// lowgain_rms=(lowgain_rms>2)?lowgain_rms:2;
-				// lowgain_rms=(lowgain_rms<5)?lowgain_rms:5;
+			time = event_time;
+			length = 0;
+			auto it = ended.find(time);
+			before = it==ended.end() ? 0 : it->second;
+			if(before>0 && !reported)
+			{
+				cout<<"Fused pedestal: Event_Time "<<time<<" of "<<dat_file<<" comes back after its run, the cuts may differ from the Raw_Hit fill"<<endl;
+				reported = true;
 			}
-			lowgain_peak=f1->GetParameter(1);
-			lowgain_rms=f1->GetParameter(2);
-			tout->Fill();
-			});
+		}
+	};
+}
+
+// Decoded events of the fused pipeline: the PedestalSelection cuts of every engine, on the stores of the calling decoder worker
+void PedestalManager::StartDecoded(const int sel_hittag,const int workers)
+{
+	decoded_hittag = sel_hittag;
+	Book();
+	worker_highgain.assign(workers,CellHistStore(1500,geometry.Cells()));
+	worker_lowgain.assign(workers,CellHistStore(1600,geometry.Cells()));
+}
+
+EventSink PedestalManager::DecodedSink(const string &dat_file,const int worker)
+{
+	const int dac_chn = decoded_hittag==1 ? DacChannel(dat_file) : -1;
+	auto file = make_shared<DecodedPedestalFile>(geometry,decoded_hittag,dac_chn,dat_file);
+	return [this,file,worker](const EventChunk &chunk,const size_t hit_begin,const size_t hit_end,const int,const unsigned int event_time){
+		file->Event(chunk,hit_begin,hit_end,event_time,worker_highgain[worker],worker_lowgain[worker]);
+	};
+}
+
+int PedestalManager::FinishDecoded()
+{
+	MergeWorkers();
+	return WritePedestal();
+}
+
+void PedestalManager::MergeWorkers()
+{
+	for(size_t w=0;w<worker_highgain.size();w++)
+	{
+		hist_highgain.Add(worker_highgain[w]);
+		hist_lowgain.Add(worker_lowgain[w]);
+	}
+	worker_highgain.clear();
+	worker_lowgain.clear();
+}
+
+int PedestalManager::WritePedestal()
+{
+	if(!fout || fout->IsZombie())
+	{
+		cout<<"cant write the pedestal output"<<endl;
+		return 0;
+	}
+	// Every cell is fitted once, the results fill both the output tree and the 2D maps
+	if(method=="robust")EstimateCells(fit_highgain,fit_lowgain);
+	else FitCells();
+	if(method=="compare")CompareEstimates();
+	for(int index=0;index<geometry.Cells();index++)
+	{
+		_cellid = geometry.FromIndex(index).Decimal();
+		highgain_peak=fit_highgain[index].peak;
+		highgain_rms=fit_highgain[index].rms;
+		lowgain_peak=fit_lowgain[index].peak;
+		lowgain_rms=fit_lowgain[index].rms;
+		tout->Fill();
+	}
 	cout<<"Out Tree Filled"<<endl;
 	fout->cd();
 	tout->Write();
-	// cout<<"time min: "<<time_min<<" max: "<<time_max<<endl;
-	// cout<<"lowgain min: "<<lowgain_min<<" max: "<<lowgain_max<<endl;
 
 	// Save hists into the output file:
-	// mode_name = times or lowgains
-	// tmp_map is the map from cellid to TH1D to loop over
-	// tmp_layer_timepeak and tmp_layer_timerms is the map from layer to peak and rms
+	// mode_name = highgain or lowgain
+	// tmp_hists are the counts of every cell and tmp_fits their fit results
+	// tmp_layer_gainpeak and tmp_layer_gainrms is the map from layer to peak and rms
 	// hpeak and hrms are the general TH2D for peak and rms
-	// alias is the alternative name. high or low
-	auto f_save = [this](TString mode_name,unordered_map<int,TH1D*> tmp_map,unordered_map<int,TH2D*> tmp_layer_gainpeak,unordered_map<int,TH2D*> tmp_layer_gainrms,std::unique_ptr<TH2D> &hpeak,std::unique_ptr<TH2D> &hrms,TString alias)
+	auto f_save = [this](TString mode_name,const CellHistStore &tmp_hists,const vector<PedestalFit> &tmp_fits,unordered_map<int,TH2D*> tmp_layer_gainpeak,unordered_map<int,TH2D*> tmp_layer_gainrms,std::unique_ptr<TH2D> &hpeak,std::unique_ptr<TH2D> &hrms)
 	{
 		fout->mkdir(TString(mode_name));
 		fout->cd(TString(mode_name));
-		for(int i=0;i<40;i++)gDirectory->mkdir(TString("layer_")+TString(to_string(i).c_str()));
-		for(auto i:tmp_map)
+		for(int i:geometry.ActiveLayers())gDirectory->mkdir(TString("layer_")+TString(to_string(i).c_str()));
+		for(int index=0;index<geometry.Cells();index++)
 		{
-			int cellid=i.first;
-			int layer = cellid/1e5;
-			int channel = cellid%100;
-			int chip = (cellid%100000)/10000;
-			double ppeak = i.second->GetBinCenter(i.second->GetMaximumBin());
-			double rrms = i.second->GetRMS();
-			double gap =3*rrms;
-			TF1 *f1=new TF1("f1","gaus");
-			TSpectrum *s = new TSpectrum(4);
-			int npeaks = s->Search(i.second,maxx(1,rrms/4),"nobackground",0.2);
-			double *xpeaks = s->GetPositionX();
-			sort(xpeaks,xpeaks+npeaks,compare);
-			if(npeaks>1){
-				gap=xpeaks[1]-xpeaks[0];
-				for(int p=1;p<npeaks-1;p++){
-					gap=minn(gap,xpeaks[p+1]-xpeaks[p]);
-				}
-			}
-			rrms=minn(0.5*gap,1.5*maxx(rrms,2));
-			// rrms=(rrms>2)?rrms:2;
-			// rrms=(rrms<5)?rrms:5;
-			for(int n=0;n<4;n++){
-				i.second->Fit(f1,"q","",ppeak-rrms,ppeak+rrms);
-				// ppeak=f1->GetParameter(1);
-				rrms=f1->GetParameter(2);
-				rrms=minn(0.5*gap,1.5*maxx(rrms,2));
-				// rrms=(rrms>2)?rrms:2;
-				// rrms=(rrms<5)?rrms:5;
-			}
-			ppeak=f1->GetParameter(1);
-			rrms=f1->GetParameter(2);
-			// if(rrms>4.5){
-			// ppeak = i.second->GetBinCenter(i.second->GetMaximumBin());
-			// rrms = i.second->GetRMS();
-			// rrms=(rrms>2)?rrms:2;
-			// rrms=(rrms<5)?rrms:5;
-			// for(int n=0;n<3;n++){
-			// i.second->Fit(f1,"q","",ppeak-0.8*rrms,ppeak+0.8*rrms);
-			// ppeak=f1->GetParameter(1);
-			// rrms=f1->GetParameter(2);
-			// rrms=(rrms>2)?rrms:2;
-			// rrms=(rrms<5)?rrms:5;
-			// }
-			// }
-			// if(cellid==140008)printf("%f",ppeak);
-			tmp_layer_gainpeak[layer]->Fill(chip,channel,ppeak);
-			tmp_layer_gainrms[layer]->Fill(chip,channel,rrms);      
-			hpeak->Fill(layer*9+chip,channel,ppeak);
-			hrms->Fill(layer*9+chip,channel,rrms);
+			const CellID id = geometry.FromIndex(index);
+			int cellid = id.Decimal();
+			int layer = id.Layer();
+			int channel = id.Channel();
+			int chip = id.Chip();
+			const PedestalFit &fit = tmp_fits[index];
+			tmp_layer_gainpeak[layer]->Fill(chip,channel,fit.peak);
+			tmp_layer_gainrms[layer]->Fill(chip,channel,fit.rms);
+			hpeak->Fill(layer*geometry.Chips()+chip,channel,fit.peak);
+			hrms->Fill(layer*geometry.Chips()+chip,channel,fit.rms);
 			TString dir_name = TString(mode_name+"/layer_") + TString(to_string(layer).c_str());
 			fout->cd(dir_name);
-			i.second->Write();
+			// The histogram is written with its last fit attached, as after TH1::Fit
+			unique_ptr<TH1D> h(tmp_hists.MakeTH1(index,mode_name+"_"+TString(to_string(cellid).c_str())));
+			TF1 *f1 = new TF1("f1","gaus",fit.xmin,fit.xmax);
+			f1->SetParameters(fit.constant,fit.peak,fit.rms);
+			h->GetListOfFunctions()->Add(f1);
+			h->Write();
 		}
-		for(int i=0;i<40;i++)
+		for(int i:geometry.ActiveLayers())
 		{
 			TString dir_name = TString(mode_name+"/layer_") + TString(to_string(i).c_str());
 			fout->cd(dir_name);
@@ -376,8 +425,8 @@ int PedestalManager::AnaPedestal(const std::string &_list,const int &sel_hittag)
 		}
 		cout<<mode_name<<" done"<<endl;
 	};
-	f_save("highgain",map_cellid_highgain,map_layer_highgainpeak,map_layer_highgainrms,highgainpeak,highgainrms,"high");
-	f_save("lowgain",map_cellid_lowgain,map_layer_lowgainpeak,map_layer_lowgainrms,lowgainpeak,lowgainrms,"low");
+	f_save("highgain",hist_highgain,fit_highgain,map_layer_highgainpeak,map_layer_highgainrms,highgainpeak,highgainrms);
+	f_save("lowgain",hist_lowgain,fit_lowgain,map_layer_lowgainpeak,map_layer_lowgainrms,lowgainpeak,lowgainrms);
 
 	fout->cd("");
 	highgainpeak->Write();
@@ -386,7 +435,416 @@ int PedestalManager::AnaPedestal(const std::string &_list,const int &sel_hittag)
 	lowgainrms->Write();
 	//fout->Close();
 	cout<<"2D hists written"<<endl;
-	return 0;
+	return 1;
+}
+
+PedestalFit PedestalManager::FitCell(TH1D *h,TF1 *f1,TSpectrum *s)
+{
+	// Start from the highest bin and the RMS, limit the fit window to half the smallest gap
+	// between the peaks TSpectrum finds, then refit 4 times with the fitted sigma
+	PedestalFit fit;
+	double peak=h->GetBinCenter(h->GetMaximumBin());
+	double rms=h->GetRMS();
+	double gap=3*rms;
+	int npeaks = s->Search(h,maxx(1,rms/4),"nobackground goff",0.2);
+	double *xpeaks = s->GetPositionX();
+	sort(xpeaks,xpeaks+npeaks,compare);
+	if(npeaks>1){
+		gap=xpeaks[1]-xpeaks[0];
+		for(int p=1;p<npeaks-1;p++){
+			gap=minn(gap,xpeaks[p+1]-xpeaks[p]);
+		}
+	}
+	rms=minn(0.5*gap,1.5*maxx(rms,2));
+	for(int n=0;n<4;n++){
+		fit.xmin=peak-rms;
+		fit.xmax=peak+rms;
+		h->Fit(f1,"q0","",fit.xmin,fit.xmax);
+		rms=f1->GetParameter(2);
+		rms=minn(0.5*gap,1.5*maxx(rms,2));
+	}
+	fit.constant=f1->GetParameter(0);
+	fit.peak=f1->GetParameter(1);
+	fit.rms=f1->GetParameter(2);
+	return fit;
+}
+
+void PedestalManager::FitCells()
+{
+	// Cells are fitted on a pool, every worker with its own TF1 and TSpectrum.
+	// Results are stored by cell index, so they do not depend on the scheduling.
+	ROOT::EnableThreadSafety();
+	FitScope scope(minimizer,nthreads,"Pedestal");
+	ThreadPool pool(scope.Workers());
+	cout<<"Pedestal fit threads: "<<pool.Size()<<endl;
+	vector< unique_ptr<TF1> > worker_f1(pool.Size());
+	vector< unique_ptr<TSpectrum> > worker_s(pool.Size());
+	for(int w=0;w<pool.Size();w++)
+	{
+		worker_f1[w] = make_unique<TF1>(TString("pedestal_fit_")+TString(to_string(w).c_str()),"gaus");
+		worker_s[w] = make_unique<TSpectrum>(4);
+	}
+	fit_highgain.assign(geometry.Cells(),PedestalFit());
+	fit_lowgain.assign(geometry.Cells(),PedestalFit());
+	const int cells_per_task = 36;
+	for(int first=0;first<geometry.Cells();first+=cells_per_task)
+	{
+		pool.Submit([this,first,cells_per_task,&worker_f1,&worker_s]{
+			const int w = ThreadPool::WorkerIndex();
+			for(int index=first;index<first+cells_per_task && index<geometry.Cells();index++)
+			{
+				int cellid = geometry.FromIndex(index).Decimal();
+				unique_ptr<TH1D> h_highgain(hist_highgain.MakeTH1(index,"highgain_"+TString(to_string(cellid).c_str())));
+				fit_highgain[index] = FitCell(h_highgain.get(),worker_f1[w].get(),worker_s[w].get());
+				unique_ptr<TH1D> h_lowgain(hist_lowgain.MakeTH1(index,"lowgain_"+TString(to_string(cellid).c_str())));
+				fit_lowgain[index] = FitCell(h_lowgain.get(),worker_f1[w].get(),worker_s[w].get());
+			}
+		});
+	}
+	pool.Wait();
+	cout<<"Pedestal fits done"<<endl;
+}
+
+namespace{
+	// Mean shift and variance factor of a unit Gaussian truncated to [a,b]
+	bool TruncatedMoments(const double a,const double b,double &shift,double &var)
+	{
+		const double phi_a=exp(-0.5*a*a)/sqrt(2.*M_PI), phi_b=exp(-0.5*b*b)/sqrt(2.*M_PI);
+		const double z=0.5*(erf(b/sqrt(2.))-erf(a/sqrt(2.)));
+		if(z<=1e-12)return false;
+		shift=(phi_a-phi_b)/z;
+		var=1.+(a*phi_a-b*phi_b)/z-shift*shift;
+		return var>0.;
+	}
+
+	// Peaks of counts[1..nbins] as TSpectrum(max_peaks)::SearchHighRes finds them without background
+	// removal, with Markov smoothing: positions from bin 0, highest counts first, as in GetPositionX.
+	// This is TSpectrum's algorithm written out, with its working space and order of the sums, except that
+	// only the bins within 7 response widths of the counts are smoothed and deconvolved. Beyond them the
+	// smoothed spectrum is flat and only enters the normalisation, which is added for the whole range.
+	// The 1% cut on the deconvolved maximum is on the maximum within those bins.
+	int SearchPeaks(const uint32_t *counts,const int ssize,const double sigma,const double threshold,const int iterations,const int aver_window,const int max_peaks,double *position)
+	{
+		if(sigma<1 || threshold<=0 || threshold>=100 || aver_window<=0)return 0;
+		if((int)(5*sigma+0.5)>=512)return 0; // Too large sigma for TSpectrum's PEAK_WINDOW
+		const int shift=(int)(7*sigma+0.5);
+		const int size_ext=ssize+2*shift;
+		auto source=[counts](const int i){return (double)counts[i+1];};
+		// Slope of the first 2 sigma bins continues the spectrum to the left
+		double l1low=0;
+		const int k=(int)(2*sigma+0.5);
+		if(k>=2)
+		{
+			double m0low=0,m1low=0,m2low=0,l0low=0;
+			for(int i=0;i<k;i++)
+			{
+				const double a=i,b=source(i);
+				m0low+=1,m1low+=a,m2low+=a*a,l0low+=b,l1low+=a*b;
+			}
+			const double detlow=m0low*m2low-m1low*m1low;
+			if(detlow!=0)l1low=(-l0low*m1low+l1low*m0low)/detlow;
+			else l1low=0;
+			if(l1low>0)l1low=0;
+		}
+		auto extended=[&](const int i){
+			double value;
+			if(i<shift)value=source(0)+l1low*(i-shift);
+			else if(i>=ssize+shift)value=source(ssize-1);
+			else return source(i-shift);
+			return value<0 ? 0. : value;
+		};
+		// Response: a Gaussian of sigma in units of 1/1000, lh_gold long, highest at posit
+		vector<double> response;
+		int lh_gold=-1,posit=0;
+		double area=0,maximum=0;
+		for(int i=0;i<size_ext;i++)
+		{
+			double lda=(double)i-3*sigma;
+			lda=lda*lda/(2*sigma*sigma);
+			lda=(int)(1000*exp(-lda));
+			if(lda!=0)lh_gold=i+1;
+			else if(i>3*sigma)break;
+			response.push_back(lda);
+			area+=lda;
+			if(lda>maximum)
+			{
+				maximum=lda;
+				posit=i;
+			}
+		}
+		// Window [e0,e1] of the extended spectrum around its nonzero bins
+		int first=-1,last=-1;
+		for(int i=0;i<size_ext;i++)
+		{
+			if(extended(i)==0)continue;
+			if(first<0)first=i;
+			last=i;
+		}
+		if(first<0)return 0;
+		const int margin=shift+k+7*lh_gold+2*aver_window;
+		const int e0=max(0,first-margin),e1=min(size_ext-1,last+margin);
+		const int size=e1-e0+1;
+		vector<double> working_space(7*size,0.);
+		double *ws=working_space.data();
+		for(int i=0;i<size;i++)ws[size+i]=ws[6*size+i]=ws[2*size+i]=extended(e0+i);
+		// Markov chain smoothing. The chain is 1 left of the window and flat right of it.
+		double maxch=0,plocha=0;
+		for(int i=0;i<size;i++)
+		{
+			maxch=maxx(maxch,ws[2*size+i]);
+			plocha+=ws[2*size+i];
+		}
+		for(int i=0;i<size;i++)ws[3*size+i]=ws[2*size+i]/maxch;
+		// Step weight between two bins; exp(0) is 1, which saves the exp in the empty bins
+		auto weight=[](const double a,const double n){
+			const double b=a-n;
+			return b==0 ? 1. : exp(b/(a+n<=0 ? 1 : sqrt(a+n)));
+		};
+		double nom=1+e0;
+		ws[0]=1;
+		for(int i=0;i<size-1;i++)
+		{
+			const double nip=ws[3*size+i];
+			const double nim=ws[3*size+i+1];
+			double sp=0,sm=0;
+			for(int l=1;l<=aver_window;l++)
+			{
+				sp+=weight(ws[3*size+min(i+l,size-1)],nip);
+				sm+=weight(ws[3*size+max(i-l+1,0)],nim);
+			}
+			nom+=ws[i+1]=ws[i]*(sp/sm);
+		}
+		for(int i=0;i<size;i++)ws[3*size+i]=0;
+		for(int i=e1+1;i<size_ext;i++)nom+=ws[size-1];
+		for(int i=0;i<size;i++)ws[i]/=nom;
+		for(int i=0;i<size;i++)ws[size+i]=ws[i]*plocha;
+		// Gold deconvolution with the response
+		for(int i=0;i<size;i++)ws[i]=i<(int)response.size() ? response[i] : 0;
+		for(int i=0;i<size;i++)ws[2*size+i]=fabs(ws[size+i]);
+		int imin=-min(lh_gold-1,size),imax=-imin;
+		for(int i=imin;i<=imax;i++)
+		{
+			double lda=0;
+			const int jmin=i<0 ? -i : 0;
+			const int jmax=min(lh_gold-1-i,lh_gold-1);
+			for(int j=jmin;j<=jmax;j++)lda+=ws[j]*ws[i+j];
+			ws[size+i-imin]=lda;
+		}
+		// The sums over j run with j outside, so that the bins are summed side by side, each still in
+		// TSpectrum's order
+		imin=-(lh_gold-1),imax=size+lh_gold-2;
+		for(int i=imin;i<=imax;i++)ws[4*size+i-imin]=0;
+		for(int j=0;j<=lh_gold-1;j++)
+		{
+			for(int i=max(imin,-j);i<=min(imax,size-1-j);i++)ws[4*size+i-imin]+=ws[j]*ws[2*size+i+j];
+		}
+		for(int i=imin;i<=imax;i++)ws[2*size+i-imin]=ws[4*size+i-imin];
+		for(int i=0;i<size;i++)ws[i]=1;
+		vector<double> folded(size); // x folded with the response twice
+		for(int n=0;n<iterations;n++)
+		{
+			fill(folded.begin(),folded.end(),0.);
+			for(int j=-(lh_gold-1);j<=lh_gold-1;j++)
+			{
+				const double band=ws[j+lh_gold-1+size];
+				for(int i=max(0,-j);i<=min(size-1,size-1-j);i++)folded[i]+=band*ws[i+j];
+			}
+			for(int i=0;i<size;i++)
+			{
+				if(fabs(ws[2*size+i])<=0.00001 || fabs(ws[i])<=0.00001)continue;
+				ws[3*size+i]=(folded[i]!=0 ? ws[2*size+i]/folded[i] : 0)*ws[i];
+			}
+			for(int i=0;i<size;i++)ws[i]=ws[3*size+i];
+		}
+		for(int i=0;i<size;i++)ws[size+(i+posit)%size]=ws[i];
+		// Deconvolved spectrum over the bins of the source, and the highest source bin
+		maximum=0;
+		double maximum_decon=0;
+		for(int i=0;i<size-(lh_gold-1);i++)
+		{
+			if(e0+i>=shift && e0+i<ssize+shift)
+			{
+				ws[i]=area*ws[size+i+lh_gold-1];
+				maximum_decon=maxx(maximum_decon,ws[i]);
+				maximum=maxx(maximum,ws[6*size+i]);
+			}
+			else ws[i]=0;
+		}
+		auto extended_source=[&](const int i){return i>=e0 && i<=e1 ? ws[6*size+i-e0] : 0.;};
+		// Local maxima above 1% of the deconvolved maximum whose source bin, as TSpectrum reads it, is
+		// above threshold % of the highest; kept by height, at most max_peaks
+		const double lda=minn(1,threshold)/100;
+		int peak_index=0;
+		for(int i=1;i<size-1;i++)
+		{
+			const int e=e0+i;
+			if(!(ws[i]>ws[i-1] && ws[i]>ws[i+1]) || e<shift || e>=ssize+shift)continue;
+			if(!(ws[i]>lda*maximum_decon && extended_source(shift+e)>threshold*maximum/100.))continue;
+			double a=0,b=0;
+			for(int j=i-1;j<=i+1;j++)
+			{
+				a+=(double)(e0+j-shift)*ws[j];
+				b+=ws[j];
+			}
+			a=a/b;
+			if(a<0)a=0;
+			if(a>=ssize)a=ssize-1;
+			if(peak_index==0)
+			{
+				position[0]=a;
+				peak_index=1;
+				continue;
+			}
+			int j=0;
+			bool priz=false;
+			for(;j<peak_index && !priz;j++)
+				priz=extended_source(shift+(int)a)>extended_source(shift+(int)position[j]);
+			if(!priz)
+			{
+				if(j<max_peaks)position[j]=a;
+			}
+			else
+			{
+				for(int p=peak_index;p>=j;p--)
+					if(p<max_peaks)position[p]=position[p-1];
+				position[j-1]=a;
+			}
+			if(peak_index<max_peaks)peak_index++;
+		}
+		return peak_index;
+	}
+}
+
+PedestalFit PedestalManager::RobustCell(const uint32_t *counts,const int nbins)
+{
+	// Closed-form version of FitCell: highest bin, the gap between the peaks TSpectrum would find, then
+	// 4 rounds of truncated mean and RMS in the same windows as the fits, corrected for the
+	// truncation. Bin b (1..nbins) is centred at b-0.5.
+	PedestalFit fit;
+	double sum=0.,sumx=0.,sumx2=0.;
+	int max_bin=1;
+	for(int b=1;b<=nbins;b++)
+	{
+		sum+=counts[b];
+		sumx+=counts[b]*(b-0.5);
+		sumx2+=counts[b]*(b-0.5)*(b-0.5);
+		if(counts[b]>counts[max_bin])max_bin=b;
+	}
+	if(sum<=0.)return fit;
+	double peak=max_bin-0.5;
+	double rms=sqrt(maxx(0.,sumx2/sum-(sumx/sum)*(sumx/sum)));
+	// Peaks as FitCell's TSpectrum(4)::Search(h,max(1,rms/4),"nobackground goff",0.2) finds them: the
+	// defaults of Search are 3 deconvolution iterations and an averaging window of 3. Each position is
+	// then moved to the centre of its bin
+	double positions[4];
+	const int npeaks=SearchPeaks(counts,nbins,maxx(1,rms/4),100*0.2,3,3,4,positions);
+	vector<double> xpeaks(npeaks);
+	for(int p=0;p<npeaks;p++)xpeaks[p]=1+(int)(positions[p]+0.5)-0.5;
+	sort(xpeaks.begin(),xpeaks.end(),compare);
+	double gap=3*rms;
+	if(xpeaks.size()>1)
+	{
+		gap=xpeaks[1]-xpeaks[0];
+		for(size_t p=1;p+1<xpeaks.size();p++)gap=minn(gap,xpeaks[p+1]-xpeaks[p]);
+	}
+	rms=minn(0.5*gap,1.5*maxx(rms,2));
+	double mean=peak,width=rms,inside=0.;
+	for(int n=0;n<4;n++)
+	{
+		fit.xmin=peak-rms;
+		fit.xmax=peak+rms;
+		// Bins of the window as TH1::Fit takes them, the data cover [lo,hi)
+		const int b_min=max(1,(int)floor(fit.xmin)+1);
+		const int b_max=min(nbins,(int)floor(fit.xmax)+1);
+		const double lo=b_min-1,hi=b_max;
+		double w=0.,wx=0.,wx2=0.;
+		for(int b=b_min;b<=b_max;b++)
+		{
+			w+=counts[b];
+			wx+=counts[b]*(b-0.5);
+			wx2+=counts[b]*(b-0.5)*(b-0.5);
+		}
+		if(w<=0.)break;
+		inside=w;
+		// Match the moments of a Gaussian truncated to [lo,hi). The unit binning is left in the width,
+		// as a Gaussian fit to the bin contents leaves it (sigma^2+1/12)
+		const double m_obs=wx/w;
+		const double var_obs=maxx(wx2/w-m_obs*m_obs,1e-6);
+		mean=m_obs;
+		width=sqrt(var_obs);
+		for(int it=0;it<50;it++)
+		{
+			double shift=0.,var=1.;
+			if(!TruncatedMoments((lo-mean)/width,(hi-mean)/width,shift,var))break;
+			const double next_width=minn(sqrt(var_obs/var),3*(hi-lo));
+			const double next_mean=m_obs-next_width*shift;
+			const bool done=fabs(next_width-width)<1e-6*width && fabs(next_mean-mean)<1e-6*width;
+			width=next_width;
+			mean=next_mean;
+			if(done)break;
+		}
+		rms=minn(0.5*gap,1.5*maxx(width,2));
+	}
+	fit.peak=mean;
+	fit.rms=width;
+	if(width>0.)fit.constant=inside/(width*sqrt(2.*M_PI)*erf((fit.xmax-fit.xmin)/2./width/sqrt(2.)));
+	return fit;
+}
+
+void PedestalManager::EstimateCells(vector<PedestalFit> &highgain,vector<PedestalFit> &lowgain)
+{
+	// No minimizer involved, so every thread is used
+	ThreadPool pool(nthreads);
+	cout<<"Pedestal robust estimate threads: "<<pool.Size()<<endl;
+	highgain.assign(geometry.Cells(),PedestalFit());
+	lowgain.assign(geometry.Cells(),PedestalFit());
+	const int cells_per_task = 36;
+	for(int first=0;first<geometry.Cells();first+=cells_per_task)
+	{
+		pool.Submit([this,first,cells_per_task,&highgain,&lowgain]{
+			for(int index=first;index<first+cells_per_task && index<geometry.Cells();index++)
+			{
+				highgain[index] = RobustCell(hist_highgain.Counts(index),hist_highgain.Bins());
+				lowgain[index] = RobustCell(hist_lowgain.Counts(index),hist_lowgain.Bins());
+			}
+		});
+	}
+	pool.Wait();
+	cout<<"Pedestal robust estimates done"<<endl;
+}
+
+int PedestalManager::CompareCells(const char *name,const CellHistStore &hists,const vector<PedestalFit> &fits,const vector<PedestalFit> &robust,const function<int(int)> &cell_id)
+{
+	// Over the cells with data; a cell disagrees when the peak or the RMS is further from the fit than the tolerances
+	int n=0,n_bad=0;
+	double sum_dpeak=0.,max_dpeak=0.,sum_drms=0.,max_drms=0.;
+	for(int index=0;index<hists.Cells();index++)
+	{
+		if(robust[index].rms<=0.)continue;
+		const double dpeak=fabs(robust[index].peak-fits[index].peak);
+		const double drms=fabs(robust[index].rms-fits[index].rms);
+		sum_dpeak+=dpeak;sum_drms+=drms;
+		max_dpeak=maxx(max_dpeak,dpeak);max_drms=maxx(max_drms,drms);
+		n++;
+		const double scale=fabs(fits[index].rms);
+		if(dpeak<=peak_tolerance[0]+peak_tolerance[1]*scale && drms<=rms_tolerance[0]+rms_tolerance[1]*scale)continue;
+		if(n_bad<10)cout<<name<<" cell "<<cell_id(index)<<": fit peak "<<fits[index].peak<<" rms "<<fits[index].rms
+			<<", robust peak "<<robust[index].peak<<" rms "<<robust[index].rms<<endl;
+		n_bad++;
+	}
+	cout<<name<<" robust vs fit over "<<n<<" cells: |dpeak| mean "<<(n?sum_dpeak/n:0.)<<" max "<<max_dpeak
+		<<", |drms| mean "<<(n?sum_drms/n:0.)<<" max "<<max_drms<<", "<<n_bad<<" outside the tolerances"<<endl;
+	return n_bad;
+}
+
+int PedestalManager::CompareEstimates()
+{
+	// Robust estimates against the fits already in fit_highgain/fit_lowgain
+	vector<PedestalFit> robust_highgain,robust_lowgain;
+	EstimateCells(robust_highgain,robust_lowgain);
+	auto cell_id=[this](int index){return geometry.FromIndex(index).Decimal();};
+	return CompareCells("highgain",hist_highgain,fit_highgain,robust_highgain,cell_id)+
+		CompareCells("lowgain",hist_lowgain,fit_lowgain,robust_lowgain,cell_id);
 }
 
 void PedestalManager::SaveCanvas(TH2D* h,const TString &name)
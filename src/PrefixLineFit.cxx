@@ -0,0 +1,55 @@
+#include "PrefixLineFit.h"
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+double LineFit::Chi2NDF() const
+{
+	return ndf>0 ? chi2/ndf : numeric_limits<double>::infinity();
+}
+
+PrefixLineFit::PrefixLineFit(const SparseHist2D &h) : hist(h)
+{
+	const int ncol = h.BinsX()+2;
+	w.assign(ncol,0.);wx.assign(ncol,0.);wy.assign(ncol,0.);
+	wxx.assign(ncol,0.);wxy.assign(ncol,0.);wyy.assign(ncol,0.);
+	h.ForEachBin([&](const int binx,const int biny,const uint32_t count){
+		if(binx<1 || binx>h.BinsX() || biny<1 || biny>h.BinsY())return;
+		const double x = h.CenterX(binx);
+		const double y = h.CenterY(biny);
+		w[binx] += count;
+		wx[binx] += count*x;
+		wy[binx] += count*y;
+		wxx[binx] += count*x*x;
+		wxy[binx] += count*x*y;
+		wyy[binx] += count*y*y;
+	});
+	for(int b=1;b<ncol;b++)
+	{
+		w[b]+=w[b-1];wx[b]+=wx[b-1];wy[b]+=wy[b-1];
+		wxx[b]+=wxx[b-1];wxy[b]+=wxy[b-1];wyy[b]+=wyy[b-1];
+	}
+}
+
+LineFit PrefixLineFit::Fit(const double xmin,const double xmax) const
+{
+	LineFit line;
+	const int first = max(1,hist.FindBinX(xmin));
+	const int last = min(hist.BinsX(),hist.FindBinX(xmax));
+	if(last<first)return line;
+	auto range = [first,last](const vector<double> &s){return s[last]-s[first-1];};
+	const double sw=range(w),sx=range(wx),sy=range(wy),sxx=range(wxx),sxy=range(wxy),syy=range(wyy);
+	line.ndf = sw-2;
+	const double det = sw*syy-sy*sy;
+	if(sw<=2. || det<=0.)
+	{
+		line.ndf = 0;
+		return line;
+	}
+	line.slope = (sw*sxy-sx*sy)/det;
+	line.intercept = (sx-line.slope*sy)/sw;
+	// Sum of (x-slope*y-intercept)^2 over the entries, from the same sums
+	line.chi2 = max(0.,sxx-line.slope*sxy-line.intercept*sx);
+	return line;
+}
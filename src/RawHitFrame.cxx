@@ -0,0 +1,55 @@
+#include "RawHitFrame.h"
+#include "ThreadPool.h"
+#include "TROOT.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+using ROOT::VecOps::RVec;
+
+namespace{
+	// Implicit multithreading has to be on before the RDataFrame is made, one slot without it.
+	// True if it is switched on here, the frame then switches it off again when it goes.
+	bool StartImplicitMT(const int threads)
+	{
+		const unsigned int n = ThreadPool::Resolve(threads);
+		if(n<=1 || ROOT::IsImplicitMTEnabled())return false;
+		ROOT::EnableImplicitMT(n);
+		return true;
+	}
+}
+
+RawHitFrame::RawHitFrame(const vector<string> &_files,const int threads,const ULong64_t skip_entries) :
+	files(_files),own_mt(StartImplicitMT(threads)),nslots(1),df("Raw_Hit",_files),node(df)
+{
+	nslots = df.GetNSlots();
+	next_entry.assign(nslots,0);
+	// A new sample is a new file (or a new range of it) on a slot, entries of one range arrive in order on that slot.
+	// file_entry is counted on every entry by the filter right after it.
+	node = node.DefinePerSample("file_index",[this](unsigned int slot,const ROOT::RDF::RSampleInfo &id){
+			next_entry[slot] = id.EntryRange().first;
+			string name = id.AsString();
+			name = name.substr(0,name.find_last_of('/')); // "file/tree"
+			auto it = find(files.begin(),files.end(),name);
+			// Per-file settings (the DAC channel) would be lost without the index
+			if(it==files.end())throw runtime_error("RawHitFrame: "+name+" is not in the file list");
+			return (int)(it-files.begin());
+		})
+		.DefineSlot("file_entry",[this](unsigned int slot,int){return next_entry[slot]++;},{"file_index"})
+		.Filter([skip_entries](ULong64_t file_entry){return file_entry>=skip_entries;},{"file_entry"});
+	const bool b_compact = df.GetColumnType("HG_Charge").find("hort")!=string::npos;
+	if(b_compact)
+	{
+		node = node.Define("hittag",[](const RVec<Char_t> &v){return RVec<int>(v.begin(),v.end());},{"HitTag"})
+			.Define("hg",[](const RVec<Short_t> &v){return RVec<double>(v.begin(),v.end());},{"HG_Charge"})
+			.Define("lg",[](const RVec<Short_t> &v){return RVec<double>(v.begin(),v.end());},{"LG_Charge"});
+	}
+	else node = node.Alias("hittag","HitTag").Alias("hg","HG_Charge").Alias("lg","LG_Charge");
+	cout<<"RDataFrame over "<<files.size()<<" files, "<<nslots<<" slots"<<(b_compact?" (compact)":"")<<endl;
+}
+
+RawHitFrame::~RawHitFrame()
+{
+	if(own_mt)ROOT::DisableImplicitMT();
+}
@@ -0,0 +1,27 @@
+#include "SparseHist2D.h"
+
+using namespace std;
+
+SparseHist2D::SparseHist2D(const int _nx,const double _xlow,const double _xup,const int _ny,const double _ylow,const double _yup) :
+	nx(_nx),xlow(_xlow),xup(_xup),ny(_ny),ylow(_ylow),yup(_yup),entries(0.)
+{
+	for(int i=0;i<7;i++)stats[i]=0.;
+}
+
+void SparseHist2D::Add(const SparseHist2D &other)
+{
+	for(auto &c:other.counts)counts[c.first]+=c.second;
+	entries+=other.entries;
+	for(int i=0;i<7;i++)stats[i]+=other.stats[i];
+}
+
+TH2D *SparseHist2D::MakeTH2(const TString &name) const
+{
+	TH2D *h = new TH2D(name,name,nx,xlow,xup,ny,ylow,yup);
+	for(auto &c:counts)h->SetBinContent(c.first,c.second);
+	double s[7];
+	for(int i=0;i<7;i++)s[i]=stats[i];
+	h->PutStats(s);
+	h->SetEntries(entries);
+	return h;
+}
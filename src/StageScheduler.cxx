@@ -0,0 +1,182 @@
+#include "StageScheduler.h"
+#include "ThreadPool.h"
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <filesystem>
+
+using namespace std;
+
+StageScheduler::StageScheduler(const bool _parallel,const int threads) : parallel(_parallel),budget(ThreadPool::Resolve(threads))
+{
+}
+
+void StageScheduler::Add(const string &name,const vector<string> &needs,const vector<string> &makes,Task task)
+{
+	Stage stage;
+	stage.name = name;
+	for(auto &file:needs)stage.needs.push_back(Normalize(file));
+	for(auto &file:makes)stage.makes.push_back(Normalize(file));
+	stage.task = move(task);
+	// Only earlier stages can be waited for, so the graph has no cycles and the adding order is a valid serial order
+	auto made_by = [](const Stage &other,const string &file){return find(other.makes.begin(),other.makes.end(),file)!=other.makes.end();};
+	for(size_t i=0;i<stages.size();i++)
+	{
+		bool wait = false;
+		for(auto &file:stage.needs)wait = wait || made_by(stages[i],file);
+		for(auto &file:stage.makes)wait = wait || made_by(stages[i],file);
+		if(wait)stage.after.push_back(i);
+	}
+	stages.push_back(move(stage));
+}
+
+string StageScheduler::Normalize(const string &path)
+{
+	// Absolute, without . and .. or symbolic links as far as the path exists, and without a trailing /
+	error_code error;
+	filesystem::path normal = filesystem::weakly_canonical(filesystem::absolute(path),error);
+	if(error)normal = filesystem::absolute(path).lexically_normal();
+	if(!normal.has_filename() && normal.has_parent_path())normal = normal.parent_path();
+	return normal.string();
+}
+
+int StageScheduler::Run()
+{
+	for(auto &stage:stages)
+	{
+		if(stage.after.empty())continue;
+		cout<<"Stage "<<stage.name<<" after:";
+		for(auto i:stage.after)cout<<" "<<stages[i].name;
+		cout<<endl;
+	}
+	return parallel ? RunParallel() : RunSerial();
+}
+
+int StageScheduler::RunSerial()
+{
+	int ok = 1;
+	for(auto &stage:stages)
+	{
+		auto failed_before = find_if(stage.after.begin(),stage.after.end(),[this](size_t i){return stages[i].state==failed;});
+		if(failed_before!=stage.after.end())
+		{
+			cout<<"Stage "<<stage.name<<": skipped, "<<stages[*failed_before].name<<" failed"<<endl;
+			stage.state = failed;
+			ok = 0;
+			continue;
+		}
+		stage.state = stage.task(0)==1 ? done : failed;
+		if(stage.state==failed)ok = 0;
+	}
+	return ok;
+}
+
+int StageScheduler::RunParallel()
+{
+	const auto start_time = chrono::steady_clock::now();
+	auto now = [&start_time]{return chrono::duration<double>(chrono::steady_clock::now()-start_time).count();};
+	cout<<"Stage threads: "<<budget<<endl;
+	int free_threads = budget,running_stages = 0;
+	while(true)
+	{
+		// Stages waiting for a failed one never run, one pass is enough since they only wait for earlier ones
+		for(auto &stage:stages)
+		{
+			if(stage.state!=pending)continue;
+			auto failed_before = find_if(stage.after.begin(),stage.after.end(),[this](size_t i){return stages[i].state==failed;});
+			if(failed_before==stage.after.end())continue;
+			cout<<"Stage "<<stage.name<<": skipped, "<<stages[*failed_before].name<<" failed"<<endl;
+			stage.state = failed;
+		}
+		vector<size_t> ready;
+		for(size_t i=0;i<stages.size();i++)
+		{
+			if(stages[i].state!=pending)continue;
+			if(all_of(stages[i].after.begin(),stages[i].after.end(),[this](size_t j){return stages[j].state==done;}))ready.push_back(i);
+		}
+		// The free threads are split evenly over the ready stages, a stage started later gets what is free then
+		for(size_t k=0;k<ready.size();k++)
+		{
+			if(free_threads<=0 && running_stages>0)break;
+			const int share = max(1,free_threads/(int)(ready.size()-k));
+			Stage &stage = stages[ready[k]];
+			stage.start = now();
+			Launch(stage,share);
+			if(stage.state!=running)continue;
+			free_threads -= share;
+			running_stages++;
+		}
+		if(running_stages==0)break;
+		int status = 0;
+		const pid_t pid = waitpid(-1,&status,0);
+		if(pid<0)
+		{
+			if(errno==EINTR)continue;
+			perror("StageScheduler: waitpid");
+			break;
+		}
+		auto stage = find_if(stages.begin(),stages.end(),[pid](const Stage &s){return s.state==running && s.pid==pid;});
+		if(stage==stages.end())continue;
+		stage->elapsed = now()-stage->start;
+		stage->state = WIFEXITED(status) && WEXITSTATUS(status)==0 ? done : failed;
+		free_threads += stage->threads;
+		running_stages--;
+		cout<<"Stage "<<stage->name<<": "<<(stage->state==done ? "done" : "FAILED");
+		if(WIFSIGNALED(status))cout<<" (signal "<<WTERMSIG(status)<<")";
+		cout<<" after "<<stage->elapsed<<" s"<<endl;
+	}
+	PrintTimes(now());
+	return all_of(stages.begin(),stages.end(),[](const Stage &s){return s.state==done;}) ? 1 : 0;
+}
+
+void StageScheduler::Launch(Stage &stage,const int threads)
+{
+	// Anything still buffered would be written by both processes
+	cout.flush();
+	fflush(stdout);
+	const pid_t pid = fork();
+	if(pid<0)
+	{
+		perror(("StageScheduler: fork of "+stage.name).c_str());
+		stage.state = failed;
+		return;
+	}
+	if(pid==0)
+	{
+		const int ok = stage.task(threads);
+		cout.flush();
+		exit(ok==1 ? 0 : 1); // exit, not _exit: ROOT closes its files at exit
+	}
+	cout<<"Stage "<<stage.name<<": started with "<<threads<<" threads"<<endl;
+	stage.pid = pid;
+	stage.threads = threads;
+	stage.state = running;
+}
+
+void StageScheduler::PrintTimes(const double total) const
+{
+	// Longest chain of waits, the time the stages would take with unlimited threads
+	vector<double> finish(stages.size(),0.);
+	double critical = 0.;
+	for(size_t i=0;i<stages.size();i++)
+	{
+		double begin = 0.;
+		for(auto j:stages[i].after)begin = max(begin,finish[j]);
+		finish[i] = begin+stages[i].elapsed;
+		critical = max(critical,finish[i]);
+	}
+	double sum = 0.;
+	cout<<"Stage times:"<<endl;
+	for(auto &stage:stages)
+	{
+		cout<<"  "<<setw(20)<<left<<stage.name<<right<<(stage.state==done ? "done  " : "failed")<<" "<<stage.elapsed<<" s"<<endl;
+		sum += stage.elapsed;
+	}
+	cout<<"Stages: "<<total<<" s, critical path "<<critical<<" s, one after another "<<sum<<" s"<<endl;
+}
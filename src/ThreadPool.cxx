@@ -0,0 +1,111 @@
+#include "ThreadPool.h"
+#include <iostream>
+#include <exception>
+
+using namespace std;
+
+namespace{
+	thread_local int worker_index = -1;
+}
+
+ThreadPool::ThreadPool(const int nthreads) : next_queue(0),queued(0),pending(0),stop(false)
+{
+	const int n = Resolve(nthreads);
+	for(int i=0;i<n;i++)queues.push_back(make_unique<TaskQueue>());
+	for(int i=0;i<n;i++)workers.emplace_back(&ThreadPool::Work,this,i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	Wait();
+	{
+		lock_guard<mutex> lk(m_sleep);
+		stop = true;
+	}
+	cv_task.notify_all();
+	for(auto &w:workers)if(w.joinable())w.join();
+}
+
+int ThreadPool::Resolve(const int nthreads)
+{
+	if(nthreads>0) return nthreads;
+	int ncore = thread::hardware_concurrency();
+	return ncore>0 ? ncore : 1;
+}
+
+int ThreadPool::WorkerIndex()
+{
+	return worker_index;
+}
+
+void ThreadPool::Submit(function<void()> task)
+{
+	TaskQueue &q = *queues[next_queue++ % queues.size()];
+	pending++;
+	{
+		lock_guard<mutex> lk(q.m);
+		q.tasks.push_back(move(task));
+	}
+	queued++;
+	{
+		lock_guard<mutex> lk(m_sleep);
+	}
+	cv_task.notify_one();
+}
+
+void ThreadPool::Wait()
+{
+	unique_lock<mutex> lk(m_done);
+	cv_done.wait(lk,[this]{return pending==0;});
+}
+
+bool ThreadPool::Pop(const int index, function<void()> &task)
+{
+	const int n = queues.size();
+	for(int k=0;k<n;k++)
+	{
+		TaskQueue &q = *queues[(index+k)%n];
+		lock_guard<mutex> lk(q.m);
+		if(q.tasks.empty())continue;
+		if(k==0)
+		{
+			task = move(q.tasks.front());
+			q.tasks.pop_front();
+		}
+		else
+		{
+			task = move(q.tasks.back());
+			q.tasks.pop_back();
+		}
+		queued--;
+		return true;
+	}
+	return false;
+}
+
+void ThreadPool::Work(const int index)
+{
+	worker_index = index;
+	while(true)
+	{
+		function<void()> task;
+		if(Pop(index,task))
+		{
+			try{
+				task();
+			}
+			catch(const exception &e){
+				cout<<"ThreadPool: task failed: "<<e.what()<<endl;
+			}
+			if(--pending==0)
+			{
+				lock_guard<mutex> lk(m_done);
+				cv_done.notify_all();
+			}
+			continue;
+		}
+		unique_lock<mutex> lk(m_sleep);
+		cv_task.wait(lk,[this]{return stop || queued>0;});
+		if(stop && queued==0) return;
+	}
+}
@@ -0,0 +1,244 @@
+#include "DatManager.h"
+#include "DatGenerator.h"
+#include "MappedFile.h"
+#include "MarkerScan.h"
+#include "ChannelUnpack.h"
+#include "ThreadPool.h"
+#include <chrono>
+#include <iomanip>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+
+using namespace std;
+
+// Decoder throughput benchmark.
+// Writes (or takes) a .dat file and times the decoding stages on it, each with its own count. "bag index"
+// finds the event bags in the mapped file; marker scan, SPIROC parsing, chip buffering and unpack start
+// from that index, each timed as the loop with its step minus the loop without it; TTree fill writes
+// events decoded beforehand; Decode is the whole DatManager::Decode.
+//   hbuana_bench [-i file.dat | -o file.dat] [-n events] [-l layers] [-k chips] [-m depth]
+//                [-p occupancy] [-g] [-e] [-r repeats] [-t decode-threads] [-d output-dir]
+// -o only writes the synthetic file; -g sets the auto-gain bits, -e the cherenkov bits.
+// -l and -k are also the layers and chips the decoder accepts.
+
+namespace{
+	class NullBuffer : public streambuf
+	{
+	protected:
+		int overflow(int c){return c;}
+	};
+
+	struct StageResult
+	{
+		string name;
+		double seconds;
+		long count;   // Items the stage produced
+		size_t bytes; // .dat bytes the stage went through
+		string unit;
+	};
+
+	// Best wall time of repeats runs, the decoder printout is swallowed while timing
+	double Time(const int repeats,const function<void()> &stage)
+	{
+		NullBuffer null_buffer;
+		double best=-1.;
+		for(int i=0;i<repeats;i++)
+		{
+			streambuf *old=cout.rdbuf(&null_buffer);
+			auto start=chrono::steady_clock::now();
+			stage();
+			double seconds=chrono::duration<double>(chrono::steady_clock::now()-start).count();
+			cout.rdbuf(old);
+			if(best<0 || seconds<best)best=seconds;
+		}
+		return best;
+	}
+
+	void Print(const vector<StageResult> &results)
+	{
+		cout<<left<<setw(20)<<"stage"<<right<<setw(12)<<"time[s]"<<setw(12)<<"MB/s"<<setw(12)<<"count"<<setw(14)<<"count/s"<<"  unit"<<endl;
+		for(auto &r:results)
+		{
+			double mb=r.bytes/1048576.;
+			cout<<left<<setw(20)<<r.name<<right<<fixed<<setprecision(3)<<setw(12)<<r.seconds
+				<<setprecision(1)<<setw(12)<<(r.seconds>0 ? mb/r.seconds : 0.)
+				<<setw(12)<<r.count
+				<<setprecision(0)<<setw(14)<<(r.seconds>0 ? r.count/r.seconds : 0.)<<"  "<<r.unit<<endl;
+		}
+		cout<<defaultfloat;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	GeneratorSettings settings;
+	string input_file="";
+	string generate_file="";
+	string output_dir="/tmp";
+	int repeats=3;
+	int decode_threads=1;
+	for(int i=1;i<argc;i++)
+	{
+		string arg=argv[i];
+		bool has_value=i+1<argc;
+		if(arg=="-i" && has_value)input_file=argv[++i];
+		else if(arg=="-o" && has_value)generate_file=argv[++i];
+		else if(arg=="-n" && has_value)settings.events=atoi(argv[++i]);
+		else if(arg=="-l" && has_value)settings.layers=min(CellID::n_layer,atoi(argv[++i]));
+		else if(arg=="-k" && has_value)settings.chips=min(CellID::n_chip,atoi(argv[++i]));
+		else if(arg=="-m" && has_value)settings.memory_depth=max(1,atoi(argv[++i]));
+		else if(arg=="-p" && has_value)settings.occupancy=atof(argv[++i]);
+		else if(arg=="-g")settings.auto_gain=true;
+		else if(arg=="-e")settings.cherenkov=true;
+		else if(arg=="-r" && has_value)repeats=max(1,atoi(argv[++i]));
+		else if(arg=="-t" && has_value)decode_threads=atoi(argv[++i]);
+		else if(arg=="-d" && has_value)output_dir=argv[++i];
+		else
+		{
+			cout<<"unknown option "<<arg<<endl;
+			return 1;
+		}
+	}
+	const Geometry geometry(settings.layers,settings.chips); // Of the generated file, -l and -k for an input one
+	if(generate_file!="" || input_file=="")
+	{
+		string fname = generate_file!="" ? generate_file : output_dir+"/AHCAL_Run0_bench.dat";
+		cout<<"Writing "<<settings.events<<" events, "<<settings.layers<<" layers x "<<settings.chips<<" chips, depth "<<settings.memory_depth
+			<<", occupancy "<<settings.occupancy<<", auto gain "<<settings.auto_gain<<", cherenkov "<<settings.cherenkov<<" to "<<fname<<endl;
+		DatGenerator generator(settings);
+		if(!generator.Write(fname))return 1;
+		if(generate_file!="")return 0;
+		input_file=fname;
+	}
+
+	MappedFile f_map;
+	if(!f_map.Open(input_file))
+	{
+		cout<<"cant map "<<input_file<<endl;
+		return 1;
+	}
+	// Bag boundaries are found once; every stage below starts from them
+	vector<EventBagRef> bags;
+	{
+		DatManager dm;
+		size_t pos=0;
+		const unsigned char *bag=nullptr;
+		size_t bag_size=0;
+		long cherenkov_counter=0;
+		NullBuffer null_buffer;
+		streambuf *old=cout.rdbuf(&null_buffer);
+		while(pos<f_map.Size())
+		{
+			if(dm.CatchEventBag(f_map,pos,bag,bag_size,cherenkov_counter))bags.push_back({bag,bag_size,cherenkov_counter});
+		}
+		cout.rdbuf(old);
+	}
+	const size_t bytes=f_map.Size();
+	const bool b_auto_gain=settings.auto_gain;
+	cout<<"Benchmark "<<input_file<<": "<<bytes<<" bytes, "<<bags.size()<<" event bags, marker scan: "<<MarkerScanISA()<<", unpack: "<<ChannelUnpackISA()<<", best of "<<repeats<<endl;
+
+	// Every stage has its own counter: event bags, markers, SPIROC bags or events
+	vector<StageResult> results;
+	size_t bag_bytes=0;
+	for(auto &ref:bags)bag_bytes+=ref.size;
+	long n_bags=0;
+	results.push_back({"bag index",Time(repeats,[&]{
+		DatManager dm;
+		size_t pos=0;
+		const unsigned char *bag=nullptr;
+		size_t bag_size=0;
+		long cherenkov_counter=0;
+		n_bags=0;
+		while(pos<bytes)
+		{
+			if(dm.CatchEventBag(f_map,pos,bag,bag_size,cherenkov_counter))n_bags++;
+		}
+	}),n_bags,bytes,"event bags"});
+
+	// The SPIROC stages and unpack only run inside DecodeEventBag, each after the ones before it:
+	// every loop below repeats the previous one plus its own step, and the stage is the difference.
+	long n_markers=0,n_spiroc=0,n_events=0;
+	auto spiroc_loop=[&](const bool b_parse,const bool b_fill){
+		DatManager dm;
+		dm.SetGeometry(geometry);
+		int layer_id=0,cycleID=0,triggerID=0;
+		n_markers=0;
+		n_spiroc=0;
+		for(auto &ref:bags)
+		{
+			ScanMarkers(ref.bag,ref.size,dm._markers);
+			n_markers+=dm._markers.size();
+			if(!b_parse)continue;
+			dm._i_marker=0;
+			size_t bag_pos=0;
+			while(ref.size-bag_pos>74)
+			{
+				dm.CatchSPIROCBag(ref.bag,ref.size,bag_pos,dm._spiroc,layer_id,cycleID,triggerID);
+				n_spiroc++;
+				if(b_fill)dm.FillChipBuffer(dm._spiroc,cycleID,triggerID,layer_id);
+				else dm._spiroc.Clear();
+			}
+			dm._builder.Clear();
+		}
+	};
+	const double t_scan=Time(repeats,[&]{spiroc_loop(false,false);});
+	const double t_parse=Time(repeats,[&]{spiroc_loop(true,false);});
+	const double t_buffer=Time(repeats,[&]{spiroc_loop(true,true);});
+	const double t_decode=Time(repeats,[&]{
+		DatManager dm;
+		dm.SetGeometry(geometry);
+		EventChunk chunk;
+		n_events=0;
+		for(auto &ref:bags)
+		{
+			n_events+=dm.DecodeEventBag(ref.bag,ref.size,ref.cherenkov_counter,b_auto_gain,chunk);
+			if(chunk.cellID.size()>(1UL<<20))chunk.Clear();
+		}
+	});
+	results.push_back({"marker scan",t_scan,n_markers,bag_bytes,"markers"});
+	results.push_back({"SPIROC parsing",max(0.,t_parse-t_scan),n_spiroc,bag_bytes,"SPIROC bags"});
+	results.push_back({"chip buffering",max(0.,t_buffer-t_parse),n_spiroc,bag_bytes,"SPIROC bags"});
+	results.push_back({"unpack",max(0.,t_decode-t_buffer),n_events,bag_bytes,"events"});
+
+	// The events are decoded once into chunks, only FillChunk and the file writing are timed
+	vector<EventChunk> chunks(1);
+	{
+		DatManager dm;
+		dm.SetGeometry(geometry);
+		NullBuffer null_buffer;
+		streambuf *old=cout.rdbuf(&null_buffer);
+		for(auto &ref:bags)
+		{
+			dm.DecodeEventBag(ref.bag,ref.size,ref.cherenkov_counter,b_auto_gain,chunks.back());
+			if(chunks.back().cellID.size()>(1UL<<20))chunks.emplace_back();
+		}
+		cout.rdbuf(old);
+	}
+	long n_filled=0;
+	results.push_back({"TTree fill",Time(repeats,[&]{
+		DatManager dm;
+		dm.SetGeometry(geometry);
+		TFile *fout=TFile::Open((output_dir+"/bench_fill.root").c_str(),"RECREATE");
+		TTree *tree=new TTree("Raw_Hit","data from binary file");
+		dm.SetTreeBranch(tree);
+		tree->SetAutoFlush(dm.output.autoflush);
+		DecodeCarry carry;
+		for(auto &chunk:chunks)dm.FillChunk(chunk,tree,carry,settings.cherenkov);
+		tree->Write();
+		fout->Close();
+		delete fout;
+		n_filled=carry.Event_No;
+	}),n_filled,bag_bytes,"events"});
+
+	long n_decoded=0;
+	results.push_back({"Decode",Time(repeats,[&]{
+		DatManager dm;
+		dm.SetGeometry(geometry);
+		dm.Decode(input_file,output_dir,b_auto_gain,settings.cherenkov,true,decode_threads);
+		n_decoded=dm.summary.events;
+	}),n_decoded,bytes,"events"});
+	cout<<"Decode is the whole DatManager::Decode with "<<ThreadPool::Resolve(decode_threads)<<" decode threads"<<endl;
+	Print(results);
+	return 0;
+}
@@ -2,10 +2,33 @@
 #include "DatManager.h"
 #include "DacManager.h"
 #include "PedestalManager.h"
+#include "ThreadPool.h"
+#include "StageScheduler.h"
+#include "TROOT.h"
 #include <fstream>
+#include <memory>
+#include <algorithm>
+#include <sys/stat.h>
 
 using namespace std;
 
+namespace{
+	// Minimizers ROOT's fits can be given, empty keeps ROOT's default
+	const vector<string> fit_minimizers = {"","Minuit","Minuit2","Fumili","Fumili2","GSLMultiMin","GSLMultiFit","GSLSimAn","Genetic"};
+
+	// Option key of block into value if it is set; false, with an ERROR, if it is none of allowed
+	bool ReadOption(const YAML::Node &block,const char *key,const vector<string> &allowed,string &value)
+	{
+		if(!block[key])return true;
+		value = block[key].as<std::string>();
+		if(find(allowed.begin(),allowed.end(),value)!=allowed.end())return true;
+		cout<<"ERROR: unknown "<<key<<" \""<<value<<"\", use";
+		for(auto &a:allowed)cout<<" \""<<a<<"\"";
+		cout<<endl;
+		return false;
+	}
+}
+
 void Config::Parse(const string config_file)
 {
 	conf = YAML::LoadFile(config_file);
@@ -16,66 +39,288 @@ void Config::Parse(const string config_file)
 
 int Config::Run()
 {
+	// Layers and chips read out, shared by the decoder and the managers
+	geometry = Geometry();
+	detect_entries = 0;
+	if(conf["Geometry"])
+	{
+		YAML::Node node = conf["Geometry"];
+		const int chips = node["chips"] ? node["chips"].as<int>() : 9;
+		if(node["layers"] && node["layers"].IsSequence())geometry = Geometry(node["layers"].as< vector<int> >(),chips);
+		else geometry = Geometry(node["layers"] ? node["layers"].as<int>() : 40,chips);
+		if(node["detect"] && node["detect"].as<bool>())detect_entries = node["detect-entries"] ? node["detect-entries"].as<long>() : 1000;
+	}
+	cout<<"Geometry: "<<geometry.Describe()<<(detect_entries!=0 ? ", detected from the data by Pedestal and Calibration" : "")<<endl;
+	// Every block switched on is a stage, waiting for the stages making the files it reads:
+	// the Raw_Hit files of DAT-ROOT that are in its file list, and the pedestal file of a calibration
+	bool b_parallel = false;
+	int budget = 0;
+	if(conf["Pipeline"])
+	{
+		if(conf["Pipeline"]["parallel"])b_parallel = conf["Pipeline"]["parallel"].as<bool>();
+		if(conf["Pipeline"]["threads"])budget = conf["Pipeline"]["threads"].as<int>();
+	}
+	StageScheduler scheduler(b_parallel,budget);
+	string raw_dir = "";
 	if(conf["DAT-ROOT"]["on-off"].as<bool>())
 	{
-		cout<<"DAT mode: ON"<<endl;
-		if(conf["DAT-ROOT"]["auto-gain"].as<bool>())cout<<"auto gain mode: ON"<<endl;//<<(conf["DAT-ROOT"]["auto-gain"].as<bool>())<<endl;	
-		if(conf["DAT-ROOT"]["cherenkov"].as<bool>())cout<<"cherenkov detector: ON"<<endl;//<<(conf["DAT-ROOT"]["auto-gain"].as<bool>())<<endl;	
-		if(conf["DAT-ROOT"]["file-list"].as<std::string>()=="" || conf["DAT-ROOT"]["output-dir"].as<std::string>()=="")
-		{
-			cout<<"ERROR: Please specify file list or output-dir for dat files"<<endl;
-		}
-		else
+		raw_dir = conf["DAT-ROOT"]["output-dir"].as<std::string>();
+		vector<string> makes = {raw_dir};
+		if(conf["DAT-ROOT"]["fused"])
 		{
-			ifstream dat_list(conf["DAT-ROOT"]["file-list"].as<std::string>());
-			DatManager dm;
-			while(!dat_list.eof())
-			{
-				string dat_temp;
-				dat_list >> dat_temp;
-				if(dat_temp=="")continue;
-				dm.Decode(dat_temp,conf["DAT-ROOT"]["output-dir"].as<std::string>(),conf["DAT-ROOT"]["auto-gain"].as<bool>(),conf["DAT-ROOT"]["cherenkov"].as<bool>());
-			}
+			YAML::Node node = conf["DAT-ROOT"]["fused"];
+			const string fused_pedestal = node["pedestal"] ? node["pedestal"].as<std::string>() : "";
+			const string fused_calibration = node["calibration"] ? node["calibration"].as<std::string>() : "";
+			if(fused_pedestal=="cosmic" || fused_pedestal=="dac")makes.push_back(conf["Pedestal"][fused_pedestal=="dac" ? "DAC" : "Cosmic"]["output-file"].as<string>());
+			if(fused_calibration=="cosmic" || fused_calibration=="dac")makes.push_back(fused_calibration+"_calib.root");
 		}
+		scheduler.Add("DAT-ROOT",{},makes,[this](const int threads){return RunDat(threads);});
 	}
+	auto reads_raw = [&raw_dir](const string &list){
+		vector<string> needs;
+		if(raw_dir=="")return needs;
+		ifstream fin(list);
+		bool b_raw = !fin.is_open(); // A list not written yet may well be made of DAT-ROOT output
+		string fname;
+		const string dir = StageScheduler::Normalize(raw_dir)+"/";
+		while(!b_raw && fin>>fname)b_raw = StageScheduler::Normalize(fname).compare(0,dir.size(),dir)==0;
+		if(b_raw)needs.push_back(raw_dir);
+		return needs;
+	};
 	if(conf["Pedestal"]["on-off"].as<bool>())
 	{
-		PedestalManager::CreateInstance();
-		cout<<"Pedestal mode: ON"<<endl;
-		if(conf["Pedestal"]["Cosmic"]["on-off"].as<bool>())
+		for(string block:{"Cosmic","DAC"})
 		{
-			cout<<"Pedestal mode for cosmic events: ON"<<endl;
-			_instance->Init(conf["Pedestal"]["Cosmic"]["output-file"].as<string>().c_str());
-			_instance->Setmt(conf["Pedestal"]["Cosmic"]["usemt"].as<bool>());
-			_instance->AnaPedestal(conf["Pedestal"]["Cosmic"]["file-list"].as<std::string>(),0);
-			PedestalManager::DeleteInstance();
+			if(!conf["Pedestal"][block]["on-off"].as<bool>())continue;
+			scheduler.Add("Pedestal/"+block,reads_raw(conf["Pedestal"][block]["file-list"].as<std::string>()),
+				{conf["Pedestal"][block]["output-file"].as<string>()},[this,block](const int threads){return RunPedestal(block,threads);});
 		}
-		if(conf["Pedestal"]["DAC"]["on-off"].as<bool>())
+	}
+	if(conf["Calibration"]["on-off"].as<bool>())
+	{
+		for(string block:{"Cosmic","DAC"})
 		{
-			cout<<"Pedestal mode for DAC events: ON"<<endl;
-			_instance->Init(conf["Pedestal"]["DAC"]["output-file"].as<string>().c_str());
-			_instance->AnaPedestal(conf["Pedestal"]["DAC"]["file-list"].as<std::string>(),1);
-			PedestalManager::DeleteInstance();
+			if(!conf["Calibration"][block]["on-off"].as<bool>())continue;
+			vector<string> needs = reads_raw(conf["Calibration"][block]["file-list"].as<std::string>());
+			needs.push_back(conf["Calibration"][block]["ped-file"].as<string>());
+			const string mode = block=="DAC" ? "dac" : "cosmic";
+			scheduler.Add("Calibration/"+block,needs,{mode+"_calib.root"},[this,block](const int threads){return RunCalibration(block,threads);});
 		}
 	}
-	if(conf["Calibration"]["on-off"].as<bool>())
+	return scheduler.Run();
+}
+
+int Config::RunDat(const int threads)
+{
+	cout<<"DAT mode: ON"<<endl;
+	if(conf["DAT-ROOT"]["auto-gain"].as<bool>())cout<<"auto gain mode: ON"<<endl;//<<(conf["DAT-ROOT"]["auto-gain"].as<bool>())<<endl;	
+	if(conf["DAT-ROOT"]["cherenkov"].as<bool>())cout<<"cherenkov detector: ON"<<endl;//<<(conf["DAT-ROOT"]["auto-gain"].as<bool>())<<endl;	
+	if(conf["DAT-ROOT"]["file-list"].as<std::string>()=="" || conf["DAT-ROOT"]["output-dir"].as<std::string>()=="")
 	{
-		if(conf["Calibration"]["Cosmic"]["on-off"].as<bool>())
+		cout<<"ERROR: Please specify file list or output-dir for dat files"<<endl;
+		return 0;
+	}
+	else
+	{
+		ifstream dat_list(conf["DAT-ROOT"]["file-list"].as<std::string>());
+		if(!dat_list.is_open())
+		{
+			cout<<"ERROR: cant open "<<conf["DAT-ROOT"]["file-list"].as<std::string>()<<endl;
+			return 0;
+		}
+		bool b_mmap = conf["DAT-ROOT"]["mmap"] ? conf["DAT-ROOT"]["mmap"].as<bool>() : true;
+		if(!b_mmap)cout<<"mmap input: OFF"<<endl;
+		int nthreads = conf["DAT-ROOT"]["threads"] ? conf["DAT-ROOT"]["threads"].as<int>() : 1;
+		int decode_threads = conf["DAT-ROOT"]["decode-threads"] ? conf["DAT-ROOT"]["decode-threads"].as<int>() : 1;
+		if(threads>0)
+		{
+			decode_threads = min(decode_threads==1 ? 1 : ThreadPool::Resolve(decode_threads),threads);
+			nthreads = max(1,threads/decode_threads);
+		}
+		const string output_dir = conf["DAT-ROOT"]["output-dir"].as<std::string>();
+		const bool b_auto_gain = conf["DAT-ROOT"]["auto-gain"].as<bool>();
+		const bool b_cherenkov = conf["DAT-ROOT"]["cherenkov"].as<bool>();
+		OutputSettings output;
+		if(conf["DAT-ROOT"]["output"])
+		{
+			YAML::Node node = conf["DAT-ROOT"]["output"];
+			if(node["compact"])output.compact = node["compact"].as<bool>();
+			if(node["compression"])output.compression = node["compression"].as<std::string>();
+			if(node["compression-level"])output.compression_level = node["compression-level"].as<int>();
+			if(node["basket-size"])output.basket_size = node["basket-size"].as<int>();
+			if(node["auto-flush"])output.autoflush = node["auto-flush"].as<long>();
+		}
+		if(conf["DAT-ROOT"]["zero-suppression"])output.zero_suppression = conf["DAT-ROOT"]["zero-suppression"].as<bool>();
+		if(conf["DAT-ROOT"]["pedestal-fraction"])output.pedestal_fraction = conf["DAT-ROOT"]["pedestal-fraction"].as<double>();
+		if(output.compact)cout<<"compact output: ON"<<endl;
+		if(output.zero_suppression)cout<<"zero suppression: ON, pedestal fraction "<<output.pedestal_fraction<<endl;
+		vector<string> dat_files;
+		while(!dat_list.eof())
 		{
-			cout<<"Cosmic calibration mode:ON"<<endl;
-			DacManager dacmanager("cosmic_calib.root");
-			dacmanager.SetPedestal(conf["Calibration"]["Cosmic"]["ped-file"].as<string>().c_str());
-			dacmanager.AnaDac(conf["Calibration"]["Cosmic"]["file-list"].as<std::string>(),"cosmic");
+			string dat_temp;
+			dat_list >> dat_temp;
+			if(dat_temp=="")continue;
+			dat_files.push_back(dat_temp);
 		}
-		if(conf["Calibration"]["DAC"]["on-off"].as<bool>())
+		// Fused pipeline: the decoded events also go straight to pedestal and calibration accumulators,
+		// one set per decoding worker, and Raw_Hit is only written if asked for
+		string fused_pedestal="",fused_calibration="";
+		if(conf["DAT-ROOT"]["fused"])
 		{
-			cout<<"DAC Calibration mode:ON"<<endl;
-			DacManager dacmanager("dac_calib.root");
-			dacmanager.SetPedestal(conf["Calibration"]["DAC"]["ped-file"].as<string>().c_str());
-			dacmanager.AnaDac(conf["Calibration"]["DAC"]["file-list"].as<std::string>().c_str(),"dac");
+			YAML::Node node = conf["DAT-ROOT"]["fused"];
+			if(node["pedestal"])fused_pedestal = node["pedestal"].as<std::string>();
+			if(node["calibration"])fused_calibration = node["calibration"].as<std::string>();
+			if(node["write-raw"])output.write = node["write-raw"].as<bool>();
 		}
+		if(fused_pedestal!="" && fused_pedestal!="cosmic" && fused_pedestal!="dac")
+		{
+			cout<<"ERROR: unknown fused pedestal "<<fused_pedestal<<", use cosmic or dac"<<endl;
+			fused_pedestal="";
+		}
+		if(fused_calibration!="" && fused_calibration!="cosmic" && fused_calibration!="dac")
+		{
+			cout<<"ERROR: unknown fused calibration "<<fused_calibration<<", use cosmic or dac"<<endl;
+			fused_calibration="";
+		}
+		// Options of the fused managers, checked before anything is decoded
+		string method="",minimizer="",calib_minimizer="";
+		if(fused_pedestal!="" && (!ReadOption(conf["Pedestal"],"method",{"fit","robust","compare"},method) ||
+			!ReadOption(conf["Pedestal"],"fit-minimizer",fit_minimizers,minimizer)))return 0;
+		if(fused_calibration!="" && !ReadOption(conf["Calibration"],"fit-minimizer",fit_minimizers,calib_minimizer))return 0;
+		if(fused_pedestal=="" && fused_calibration=="")output.write = true; // Nothing else would see the events
+		if(!output.write)cout<<"Raw_Hit output: OFF"<<endl;
+		int workers = nthreads==1 ? 1 : ThreadPool::Resolve(nthreads);
+		// Every decoding worker keeps its own pedestal counts, fewer workers are started if they do not fit
+		if(fused_pedestal!="")workers = CellHistStore::WorkersInMemory(workers,PedestalManager::WorkerBytes(geometry));
+		if(fused_pedestal!="")
+		{
+			cout<<"Fused pedestal for "<<fused_pedestal<<" events: ON"<<endl;
+			const string block = fused_pedestal=="dac" ? "DAC" : "Cosmic";
+			PedestalManager::CreateInstance();
+			_instance->SetGeometry(geometry);
+			_instance->Init(conf["Pedestal"][block]["output-file"].as<string>().c_str());
+			if(conf["Pedestal"]["Cosmic"]["threads"])_instance->SetThreads(conf["Pedestal"]["Cosmic"]["threads"].as<int>());
+			if(threads>0)_instance->SetThreads(threads);
+			if(method!="")_instance->SetMethod(method);
+			_instance->SetMinimizer(minimizer);
+			_instance->StartDecoded(fused_pedestal=="dac" ? 1 : 0,workers);
+		}
+		unique_ptr<DacManager> fused_calib;
+		if(fused_calibration!="")
+		{
+			cout<<"Fused "<<fused_calibration<<" calibration: ON"<<endl;
+			const string block = fused_calibration=="dac" ? "DAC" : "Cosmic";
+			fused_calib = make_unique<DacManager>((fused_calibration+"_calib.root").c_str());
+			fused_calib->SetPedestal(conf["Calibration"][block]["ped-file"].as<string>().c_str());
+			fused_calib->SetGeometry(geometry);
+			if(conf["Calibration"]["threads"])fused_calib->SetThreads(conf["Calibration"]["threads"].as<int>());
+			fused_calib->SetMinimizer(calib_minimizer);
+			if(conf["Calibration"]["fit-range-scan"])fused_calib->SetRangeScan(conf["Calibration"]["fit-range-scan"].as<bool>());
+			if(threads>0)fused_calib->SetThreads(threads);
+			fused_calib->StartDecoded(fused_calibration.c_str(),workers);
+		}
+		auto attach_sinks = [&](DatManager &dm,const string &dat_file,const int worker){
+			dm.sinks.clear();
+			if(fused_pedestal!="")dm.sinks.push_back(_instance->DecodedSink(dat_file,worker));
+			if(fused_calib)dm.sinks.push_back(fused_calib->DecodedSink(dat_file,worker));
+		};
+		vector<DecodeSummary> summaries(dat_files.size());
+		if(nthreads==1)
+		{
+			DatManager dm;
+			dm.output=output;
+			dm.SetGeometry(geometry);
+			for(size_t i=0;i<dat_files.size();i++)
+			{
+				attach_sinks(dm,dat_files[i],0);
+				dm.Decode(dat_files[i],output_dir,b_auto_gain,b_cherenkov,b_mmap,decode_threads);
+				summaries[i]=dm.summary;
+			}
+		}
+		else
+		{
+			// Every file gets its own DatManager and TFile, biggest file first
+			ROOT::EnableThreadSafety();
+			vector<size_t> order(dat_files.size());
+			vector<long> file_size(dat_files.size(),0);
+			for(size_t i=0;i<dat_files.size();i++)
+			{
+				order[i]=i;
+				struct stat st;
+				if(stat(dat_files[i].c_str(),&st)==0)file_size[i]=st.st_size;
+			}
+			stable_sort(order.begin(),order.end(),[&file_size](size_t a,size_t b){return file_size[a]>file_size[b];});
+			ThreadPool pool(workers);
+			cout<<"DAT-ROOT threads: "<<pool.Size()<<endl;
+			for(auto i:order)
+			{
+				pool.Submit([&,i]{
+					DatManager dm;
+					dm.output=output;
+					dm.SetGeometry(geometry);
+					attach_sinks(dm,dat_files[i],ThreadPool::WorkerIndex());
+					dm.Decode(dat_files[i],output_dir,b_auto_gain,b_cherenkov,b_mmap,decode_threads);
+					summaries[i]=dm.summary;
+				});
+			}
+			pool.Wait();
+		}
+		DatManager::PrintSummary(summaries);
+		// Failed when a file failed to decode or there was none, the fused outputs are written anyway
+		int ok = dat_files.empty() ? 0 : 1;
+		if(dat_files.empty())cout<<"ERROR: no dat files in "<<conf["DAT-ROOT"]["file-list"].as<std::string>()<<endl;
+		for(auto &summary:summaries)if(summary.status!=1)ok = 0;
+		if(fused_pedestal!="")
+		{
+			if(_instance->FinishDecoded()!=1)ok = 0;
+			PedestalManager::DeleteInstance();
+		}
+		if(fused_calib && fused_calib->FinishDecoded()!=1)ok = 0;
+		return ok;
 	}
-	return 1;
+}
+
+int Config::RunPedestal(const string &block,const int threads)
+{
+	cout<<"Pedestal mode: ON"<<endl;
+	cout<<(block=="DAC" ? "Pedestal mode for DAC events: ON" : "Pedestal mode for cosmic events: ON")<<endl;
+	string method="",engine="",minimizer="";
+	if(!ReadOption(conf["Pedestal"],"method",{"fit","robust","compare"},method) ||
+		!ReadOption(conf["Pedestal"],"engine",{"native","rdf","compare"},engine) ||
+		!ReadOption(conf["Pedestal"],"fit-minimizer",fit_minimizers,minimizer))return 0;
+	PedestalManager::CreateInstance();
+	_instance->SetGeometry(geometry,detect_entries);
+	_instance->Init(conf["Pedestal"][block]["output-file"].as<string>().c_str());
+	if(block=="Cosmic")
+	{
+		_instance->Setmt(conf["Pedestal"]["Cosmic"]["usemt"].as<bool>());
+		if(conf["Pedestal"]["Cosmic"]["threads"])_instance->SetThreads(conf["Pedestal"]["Cosmic"]["threads"].as<int>());
+	}
+	if(threads>0)_instance->SetThreads(threads);
+	if(method!="")_instance->SetMethod(method);
+	if(engine!="")_instance->SetEngine(engine);
+	_instance->SetMinimizer(minimizer);
+	const int ok = _instance->AnaPedestal(conf["Pedestal"][block]["file-list"].as<std::string>(),block=="DAC" ? 1 : 0);
+	PedestalManager::DeleteInstance();
+	return ok;
+}
+
+int Config::RunCalibration(const string &block,const int threads)
+{
+	const string mode = block=="DAC" ? "dac" : "cosmic";
+	cout<<(block=="DAC" ? "DAC Calibration mode:ON" : "Cosmic calibration mode:ON")<<endl;
+	string engine="",minimizer="";
+	if(!ReadOption(conf["Calibration"],"engine",{"native","rdf"},engine) ||
+		!ReadOption(conf["Calibration"],"fit-minimizer",fit_minimizers,minimizer))return 0;
+	DacManager dacmanager((mode+"_calib.root").c_str());
+	dacmanager.SetPedestal(conf["Calibration"][block]["ped-file"].as<string>().c_str());
+	dacmanager.SetGeometry(geometry,detect_entries);
+	if(engine!="")dacmanager.SetEngine(engine);
+	dacmanager.SetMinimizer(minimizer);
+	if(conf["Calibration"]["fit-range-scan"])dacmanager.SetRangeScan(conf["Calibration"]["fit-range-scan"].as<bool>());
+	if(conf["Calibration"]["threads"])dacmanager.SetThreads(conf["Calibration"]["threads"].as<int>());
+	if(threads>0)dacmanager.SetThreads(threads);
+	return dacmanager.AnaDac(conf["Calibration"][block]["file-list"].as<std::string>(),mode.c_str());
 }
 
 void Config::Print()
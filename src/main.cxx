@@ -10,6 +10,7 @@ int main(int argc, char* argv[])
 	time_t time1,time2;
 	clock_t startTime,endTime;
 	float diff_time;
+	int ok = 1;
 	time(&time1);
 	startTime = clock();
 	Config config;
@@ -22,7 +23,7 @@ int main(int argc, char* argv[])
 			string config_file="";
 			config_file=string(argv[i+1]);
 			config.Parse(config_file);
-			config.Run();
+			if(config.Run()!=1)ok = 0;
 		}
 		else if(string(argv[i])=="-x")
 		{
@@ -35,5 +36,5 @@ int main(int argc, char* argv[])
 	diff_time = difftime(time2,time1);
 	cout<<"Running(CPU) time: "<<(double)(endTime - startTime) / CLOCKS_PER_SEC<<" s."<<endl;
 	cout<<"Actual time: "<<diff_time<<" s."<<endl;
-	return 1;
+	return ok==1 ? 0 : 1;
 }
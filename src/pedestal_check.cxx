@@ -0,0 +1,118 @@
+#include "PedestalManager.h"
+#include "CellHistStore.h"
+#include "ThreadPool.h"
+#include "FitScope.h"
+#include <TF1.h>
+#include <TSpectrum.h>
+#include <TRandom3.h>
+#include <iostream>
+#include <memory>
+#include <cstdlib>
+#include <chrono>
+
+using namespace std;
+
+// Robust pedestal estimates against the fits on synthetic cells.
+// Every cell is a Gaussian pedestal, every fourth one with a second, smaller peak above it (the
+// neighbouring peaks the TSpectrum gap is there for). Both estimates run on the pool, the same way
+// PedestalManager does them; the exit code is 1 if any cell is outside PedestalManager's tolerances.
+//   hbuana_pedestal_check [-n cells] [-e entries] [-s seed] [-t threads] [-m minimizer]
+// The fits use one thread unless -m Minuit2 is given, as in the pedestal fit-minimizer setting.
+
+namespace{
+	// Bins of the highgain pedestal histograms
+	const int nbins=1500;
+
+	void FillCells(CellHistStore &hists,const int entries,const int seed)
+	{
+		TRandom3 random(seed);
+		for(int index=0;index<hists.Cells();index++)
+		{
+			const double peak=random.Uniform(250.,450.);
+			const double rms=random.Uniform(2.,8.);
+			const bool second=index%4==3;
+			const double peak2=peak+random.Uniform(6.,12.)*rms;
+			for(int i=0;i<entries;i++)
+			{
+				if(second && random.Rndm()<0.15)hists.Fill(index,random.Gaus(peak2,rms));
+				else hists.Fill(index,random.Gaus(peak,rms));
+			}
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int cells=3600;
+	int entries=5000;
+	int seed=4357;
+	int threads=0;
+	string minimizer="";
+	for(int i=1;i<argc;i++)
+	{
+		string arg=argv[i];
+		bool has_value=i+1<argc;
+		if(arg=="-n" && has_value)cells=max(1,atoi(argv[++i]));
+		else if(arg=="-e" && has_value)entries=max(1,atoi(argv[++i]));
+		else if(arg=="-s" && has_value)seed=atoi(argv[++i]);
+		else if(arg=="-t" && has_value)threads=atoi(argv[++i]);
+		else if(arg=="-m" && has_value)minimizer=argv[++i];
+		else
+		{
+			cout<<"unknown option "<<arg<<endl;
+			return 1;
+		}
+	}
+	CellHistStore hists(nbins,cells);
+	FillCells(hists,entries,seed);
+	cout<<cells<<" cells of "<<entries<<" entries, seed "<<seed<<endl;
+
+	vector<PedestalFit> fits(cells),robust(cells);
+	const int cells_per_task=36;
+	{
+		ROOT::EnableThreadSafety();
+		FitScope scope(minimizer,threads,"Pedestal check");
+		ThreadPool pool(scope.Workers());
+		cout<<"Fit threads: "<<pool.Size()<<endl;
+		vector< unique_ptr<TF1> > worker_f1(pool.Size());
+		vector< unique_ptr<TSpectrum> > worker_s(pool.Size());
+		vector< unique_ptr<TH1D> > worker_h(pool.Size());
+		for(int w=0;w<pool.Size();w++)
+		{
+			worker_f1[w] = make_unique<TF1>(TString("pedestal_check_")+TString(to_string(w).c_str()),"gaus");
+			worker_s[w] = make_unique<TSpectrum>(4);
+			worker_h[w].reset(hists.MakeTH1(0,TString("pedestal_check_h_")+TString(to_string(w).c_str())));
+		}
+		const auto start=chrono::steady_clock::now();
+		for(int first=0;first<cells;first+=cells_per_task)
+		{
+			pool.Submit([&,first]{
+				const int w = ThreadPool::WorkerIndex();
+				for(int index=first;index<first+cells_per_task && index<cells;index++)
+				{
+					hists.CopyTo(worker_h[w].get(),index);
+					fits[index] = PedestalManager::FitCell(worker_h[w].get(),worker_f1[w].get(),worker_s[w].get());
+				}
+			});
+		}
+		pool.Wait();
+		cout<<"Fits: "<<chrono::duration<double,milli>(chrono::steady_clock::now()-start).count()<<" ms"<<endl;
+	}
+	{
+		ThreadPool pool(threads);
+		cout<<"Robust estimate threads: "<<pool.Size()<<endl;
+		const auto start=chrono::steady_clock::now();
+		for(int first=0;first<cells;first+=cells_per_task)
+		{
+			pool.Submit([&,first]{
+				for(int index=first;index<first+cells_per_task && index<cells;index++)
+					robust[index] = PedestalManager::RobustCell(hists.Counts(index),hists.Bins());
+			});
+		}
+		pool.Wait();
+		cout<<"Robust estimates: "<<chrono::duration<double,milli>(chrono::steady_clock::now()-start).count()<<" ms"<<endl;
+	}
+	const int n_bad=PedestalManager::CompareCells("synthetic",hists,fits,robust,[](int index){return index;});
+	cout<<(n_bad==0 ? "Pedestal check passed" : "Pedestal check FAILED")<<endl;
+	return n_bad==0 ? 0 : 1;
+}